@@ -9,6 +9,19 @@
 #include <fcntl.h>
 #include "trctl.h"
 
+/* knobs settable as name=value */
+static const struct {
+	const char *name;
+	int knob;
+	int min;
+} knobs[] = {
+	{ "getattr_sample", TRFS_KNOB_GETATTR_SAMPLE, 1 },
+	{ "coalesce_ms", TRFS_KNOB_COALESCE_MS, 0 },
+	{ "payload_cap", TRFS_KNOB_PAYLOAD_CAP, -1 },
+	{ "dedup", TRFS_KNOB_DEDUP, 0 },
+	{ "fault_sample", TRFS_KNOB_FAULT_SAMPLE, 1 },
+	{ NULL, 0, 0 }
+};
 
 int main(int argc , char * argv[])
 {
@@ -18,6 +31,8 @@ int main(int argc , char * argv[])
 	
 	int ret,i;
 	char * validate_hex;
+	struct trfs_knob knob;
+	size_t len=0;
 	unsigned long x=0;
 	if(argc!=2 && argc!=3)
 	{
@@ -28,11 +43,37 @@ int main(int argc , char * argv[])
 		
 		strcpy(mount_point, argv[2]);
 		//fd = open(mount_point,O_RDONLY);
-		strcpy(validate_hex,argv[1]);
+		validate_hex = argv[1];
 		
 		
 		
-		if(strcmp(argv[1],"all")==0)
+		if(strchr(argv[1],'=')!=NULL)
+		{
+			/* name=value sets a knob, e.g. getattr_sample=100 */
+			for(i=0;knobs[i].name;i++)
+			{
+				len=strlen(knobs[i].name);
+				if(strncmp(argv[1],knobs[i].name,len)==0 && argv[1][len]=='=')
+					break;
+			}
+			if(!knobs[i].name || atoi(argv[1]+len+1)<knobs[i].min)
+			{
+				printf("Error : Acceptable knobs are getattr_sample=<N>, N >= 1, coalesce_ms=<ms>, 0 is off, payload_cap=<bytes>, -1 is all, dedup=<0|1> and fault_sample=<N>, N >= 1 \n");
+				exit(1);
+			}
+			knob.knob=knobs[i].knob;
+			knob.value=atoi(argv[1]+len+1);
+			fd = open(mount_point,O_RDONLY);
+			if(fd <0 )
+			{
+				printf(" failed to open %s \n",mount_point);
+				exit (1);
+			}
+			ret=ioctl(fd,TRFS_SET_KNOB,&knob);
+			if(ret<0)
+				perror("TRFS_SET_KNOB");
+		}
+		else if(strcmp(argv[1],"all")==0)
 		{	
 			x=2147483647;
 			fd = open(mount_point,O_RDONLY);
@@ -59,7 +100,7 @@ int main(int argc , char * argv[])
 		else if(strcmp(argv[1],"all")!=0 && strcmp(argv[1],"none")!=0)
 		{
 			if(validate_hex[0]!='0' || validate_hex[1]!='x' || (validate_hex[strspn(validate_hex, "0123456789xabcdefABCDEF")] != 0))
-				printf("Error : Usage is ./trctl cmd /mounted/path \n or ./trctl /mounted/path : Acceptable values for cmd -<all> <none> <0xab> \n");
+				printf("Error : Usage is ./trctl cmd /mounted/path \n or ./trctl /mounted/path : Acceptable values for cmd -<all> <none> <0xab> <knob=value> \n");
 			else 
 			{	
 				x=strtol(argv[1], NULL, 16);
@@ -92,6 +133,13 @@ int main(int argc , char * argv[])
 		
 		printf("current value of bitmap set to  : 0x%x \n",x);
 		
+		for(i=0;knobs[i].name;i++)
+		{
+			knob.knob=knobs[i].knob;
+			if(ioctl(fd,TRFS_GET_KNOB,&knob)==0)
+				printf("%s : %d \n",knobs[i].name,knob.value);
+		}
+		
 	}
 		
    	                         
@@ -9,4 +9,72 @@
 #define BITMAP_NONE_VALUE 		_IOW(MAGIC_NUMBER, 2, int)
 #define BITMAP_HEX_VALUE	    _IOW(MAGIC_NUMBER, 3, int)
 
+/* bitmap bits, one per traced method (shared by trfs, trctl and treplay) */
+#define TRFS_TRACE_OPEN		0x01
+#define TRFS_TRACE_READ		0x02
+#define TRFS_TRACE_WRITE	0x04
+#define TRFS_TRACE_CLOSE	0x10
+#define TRFS_TRACE_MKDIR	0x40
+#define TRFS_TRACE_RMDIR	0x80
+#define TRFS_TRACE_CREATE	0x100
+#define TRFS_TRACE_UNLINK	0x200
+#define TRFS_TRACE_RENAME	0x400
+#define TRFS_TRACE_LINK		0x800
+#define TRFS_TRACE_SYMLINK	0x1000
+#define TRFS_TRACE_MKNOD	0x2000
+#define TRFS_TRACE_SETATTR	0x4000
+#define TRFS_TRACE_GETATTR	0x8000
+#define TRFS_TRACE_XATTR	0x10000
+#define TRFS_TRACE_FSYNC	0x20000
+#define TRFS_TRACE_FLUSH	0x40000
+#define TRFS_TRACE_LLSEEK	0x80000
+#define TRFS_TRACE_FALLOCATE	0x100000
+#define TRFS_TRACE_READDIR	0x200000
+#define TRFS_TRACE_LOOKUP	0x400000	/* very hot, kept apart from readdir */
+#define TRFS_TRACE_COPY		0x800000	/* copy_file_range and clones */
+#define TRFS_TRACE_FADVISE	0x1000000	/* readahead hints */
+#define TRFS_TRACE_FAULT	0x2000000	/* mmap faults, sampled */
+
+/* tunables besides the bitmap, read and set with TRFS_GET_KNOB/TRFS_SET_KNOB */
+#define TRFS_KNOB_GETATTR_SAMPLE	1	/* trace 1 in N getattr calls */
+#define TRFS_KNOB_COALESCE_MS		2	/* coalesce sequential I/O, 0 is off */
+#define TRFS_KNOB_PAYLOAD_CAP		3	/* data bytes kept per read/write, -1 all */
+#define TRFS_KNOB_DEDUP			4	/* 1 dedups write data, see below */
+#define TRFS_KNOB_FAULT_SAMPLE		5	/* trace 1 in N mmap faults */
+
+/*
+ * Bytes kept field of a read or write record when the user buffer could
+ * not be read: no data follows and the digest means nothing.
+ */
+#define TRFS_PAYLOAD_NONE	0xffffffff
+
+/*
+ * With dedup on, write data goes in 'W' records as TRFS_DEDUP_CHUNK byte
+ * chunks, each a TRFS_CHUNK_DATA byte followed by the data, or for a full
+ * chunk already in one of the last TRFS_DEDUP_WINDOW records a
+ * TRFS_CHUNK_REF byte, the int record id and the u16 chunk index there.
+ */
+#define TRFS_DEDUP_CHUNK	512
+#define TRFS_DEDUP_WINDOW	1024
+#define TRFS_CHUNK_DATA		0
+#define TRFS_CHUNK_REF		1
+
+struct trfs_knob {
+	int knob;
+	int value;
+};
+
+#define TRFS_GET_KNOB		_IOWR(MAGIC_NUMBER, 4, struct trfs_knob)
+#define TRFS_SET_KNOB		_IOW(MAGIC_NUMBER, 5, struct trfs_knob)
+
+/* ia_valid bits kept in setattr records, same values as the kernel's ATTR_* */
+#define TRFS_ATTR_MODE		(1 << 0)
+#define TRFS_ATTR_UID		(1 << 1)
+#define TRFS_ATTR_GID		(1 << 2)
+#define TRFS_ATTR_SIZE		(1 << 3)
+#define TRFS_ATTR_ATIME		(1 << 4)
+#define TRFS_ATTR_MTIME		(1 << 5)
+#define TRFS_ATTR_ATIME_SET	(1 << 7)
+#define TRFS_ATTR_MTIME_SET	(1 << 8)
+
 #endif
@@ -1,480 +1,1414 @@
-#include <stdio.h>
-#include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <asm/unistd.h>
-#include <sys/syscall.h>
-
-#include "treplay.h"
-
-#define mode_default 0
-#define mode_n 1
-#define mode_s 2
-
-
-int main(int argc, char *argv[])
-{
-   int stream;
-   char *buffer;
-   int c;
-   char * filename;
-   char *ptr;
-   
-
-    char buf_record_size[2];
-	unsigned short record_size=0;
-	int record_id=0;
-	char record_type;
-	int mode=mode_default;
-	lookup lookup_arr[500];
-	open_struct open1;
-	write_struct write1;
-	read_struct read1;
-	close_struct close1;
-	mkdir_struct mkdir1;
-	rmdir_struct rmdir1;
-	char ch;
-	int retval;
-	int lookup_index=0;
-	int i;
-	
-	//getopt for parsing -s or -n option
-	while ((c = getopt (argc, argv, "ns")) != -1)
-    switch (c)
-      {
-      case 'n':
-	  if(mode==mode_s)
-	  {
-		  printf("options -n or -s not -n and -s \n");
-		  exit(0);
-	  }
-        mode=mode_n;
-        break;
-      case 's':
-        if(mode==mode_n)
-		{
-			printf("options -n or -s not -n and -s \n");
-			exit(0);
-		}
-		mode=mode_s;
-        break;
-	  
-	  case '?':
-		printf("Usage : ./treplay [-ns] TFILE \n");
-        return 1;
-      
-	  default:
-		printf("mode not specified");
-        abort ();
-      }
-	  filename=argv[optind];
-	  stream = open(filename,2);
-	  
-	  
-	  if(optind > 3 )
-	  {
-		  printf("Usage : ./treplay [-ns] TFILE \n");
-		  exit(1);	
-	  }
-	 
-	if(stream<0)
-	{
-		printf("Error in opening file \n");
-		exit(0);
-	}
-	  
-	
-	while(1)
-	{	
-		retval=read(stream,buf_record_size,2);
-		if(retval==0) 
-		{
-			break;
-		}
-		
-		//getting record_size 
-		record_size=(unsigned short)*buf_record_size;
-		printf("record size : %d \n",record_size);
-		record_size=record_size-2; 
-		
-		//getting a single record into buffer
-		buffer=(char *)malloc(record_size);   
-		read(stream,buffer,record_size);
-		ptr=buffer; 
-		
-		//obtaining record_id
-		record_id=(int)*ptr;
-		ptr=ptr+sizeof(int);
-		printf("record id is : %d \n",record_id);
-		
-		record_type=(int)*ptr;//record_type from buffer
-		
-		
-		
-		switch(record_type){
-			case 'o':
-				
-				printf("record type : open \n");
-				ptr=ptr+sizeof(char);
-				
-				open1.flags=(unsigned int)*ptr;
-				printf("flags : %d \n",open1.flags);
-				ptr=ptr+sizeof(unsigned int);
-		
-				open1.mode=(unsigned short)*ptr;
-				printf("mode is: %hu \n",open1.mode);
-				ptr=ptr+sizeof(unsigned short);
-				
-				open1.pathname_length=(unsigned short)*ptr;
-				printf("path name length : %hu \n",open1.pathname_length);
-				ptr=ptr+sizeof(unsigned short);
-				
-				open1.pathname=(char *)malloc (open1.pathname_length);
-				strncpy(open1.pathname,ptr,open1.pathname_length);
-				printf("path is : %s \n", open1.pathname);
-				ptr=ptr+sizeof(open1.pathname_length);
-				
-				open1.errno=(int)*ptr;
-				ptr=ptr+sizeof(int);
-
-				if(mode==mode_default)
-				{
-					open1.retval=open(open1.pathname,open1.flags,open1.mode);
-					printf("traced system call return value is : %d \n",open1.retval);
-					printf("TRFS call return value is : %d \n ",open1.errno);
-				}
-				if (mode==mode_s)
-				{	
-					open1.retval=open(open1.pathname,open1.flags,open1.mode);
-					if(open1.errno<0 && open1.retval>=0 || open1.errno>=0 && open1.retval<0)
-					{
-						printf("Deviation in TRFS call and traced system call \n");
-						printf("traced system call return value is : %d \n",open1.retval);
-						printf("TRFS call return value is : %d \n ",open1.errno);
-						exit(0);
-					}
-					
-					if(open1.errno < 0 && open1.retval<0)
-					{
-						if(open1.errno!=open1.retval)
-						{
-							printf("Deviation - return value in TRFS call : %d , return value in traced call %d",open1.errno,open1.retval );
-							exit(0);
-						}
-						
-					}
-					
-					printf("No deviation in traced and TRFS call \n");
-					printf("traced system call return value is :%d \n",open1.retval);
-				
-				printf("TRFS call return value is : %d \n ",open1.errno);
-				}
-					
-				lookup_arr[lookup_index].key=record_id;//record_is used as key for lookup 
-				lookup_arr[lookup_index].fd=open1.retval;//fd to be used for corresponding read and write calls
-				lookup_index++;
-				
-				
-				break;
-			
-			case 'w':
-				
-				printf("record type : write\n");
-				ptr=ptr+sizeof(char);
-				
-				//to lookup the corresponding open
-				write1.record_id_open=(int)* ptr;
-				printf("corresponding open record_id : %d \n", write1.record_id_open);
-				ptr=ptr+sizeof(int);
-				
-				//number of bytes to be written as entered by user
-				write1.count=(size_t)*ptr;
-				printf("number of bytes to be written : %d \n",write1.count);
-				ptr=ptr+sizeof(size_t);
-				
-				write1.buf=(char *)malloc(write1.count);
-				strncpy(write1.buf,ptr,write1.count);
-				printf("content in the write buffer : %s \n",write1.buf);
-				ptr=ptr+write1.count;
-				
-				//return value from trfs_write
-				write1.errno=(int) * ptr;
-				ptr=ptr+sizeof(int);
-				
-				
-				//to get fd of corresponding open call from lookup 
-				for (i=0;i<lookup_index;i++)
-				{
-					if(write1.record_id_open==lookup_arr[i].key)
-						write1.fd=lookup_arr[i].fd;
-				}
-				
-				
-				if(mode==mode_default)
-				{
-					
-					if(write1.fd<0)
-						printf("open before write failed \n");
-					else
-					{
-						write1.num_bytes=write(write1.fd,write1.buf,write1.count);
-						printf("traced system call return value is : %d \n",write1.num_bytes);
-						printf("TRFS call return value is : %d \n ",write1.errno);
-					}
-				}
-				
-				if (mode==mode_s)
-				{
-					if(write1.fd<0)
-					{
-						printf("open before write failed \n");
-						exit(0);
-					}
-					write1.num_bytes=write(write1.fd,write1.buf,write1.count);
-					if(write1.num_bytes!=write1.count)
-					{
-						printf("Deviation - written bytes in TRFS call : %d , written bytes in traced call : %d \n",write1.count,write1.num_bytes);
-						exit(0);
-					}
-					
-					printf("No deviation in traced and TRFS call \n");
-					printf("traced system call return value is : %d \n",write1.num_bytes);
-				
-				printf("TRFS call return value is :%d \n ",write1.errno);
-				}
-				if(write1.buf)
-					free(write1.buf); 
-				break;
-			
-			case 'r':
-				
-				printf("record type : read \n");
-				ptr=ptr+sizeof(char);
-				
-				read1.record_id_open=(int)* ptr;
-				printf("corresponding open record_id : %d \n",read1.record_id_open);
-				ptr=ptr+sizeof(int);
-				
-				//bytes to be read as entered by the user
-				read1.user_bytes=(size_t)*ptr;
-				printf("number of bytes entered by user : %d \n",read1.user_bytes);
-				ptr=ptr+sizeof(size_t);
-				
-				//return value from trfs_read
-				read1.errno=(int)*ptr;
-				printf("number of bytes read : %d \n",read1.errno);
-				ptr=ptr+sizeof(int); 
-				
-				//to get fd of corresponding open call from lookup 
-				for(i=0;i<lookup_index;i++)
-				{
-					if(read1.record_id_open==lookup_arr[i].key)
-					{
-						read1.fd=lookup_arr[i].fd;
-					}
-				}
-				
-				if(read1.errno>=0)  
-				{
-					read1.buf=(char *)malloc(read1.errno);
-					strncpy(read1.buf,ptr,read1.errno); //content read at trfs_level
-					printf("content read to buffer : %s \n ",read1.buf);
-					ptr=ptr+read1.errno; 
-				}
-					
-				if(mode==mode_default)
-				{
-					if(read1.fd<0)
-						printf("open before read failed \n");
-					else
-					{
-						read1.trace_buf=(char *)malloc(read1.errno); 
-						read1.num_bytes=read(read1.fd,read1.trace_buf,read1.errno);
-						printf("traced system call return value is : %d \n",read1.num_bytes);
-					    printf("TRFS call return value is :%d \n ",read1.errno);
-					}
-				}
-				
-				if (mode==mode_s)
-				{
-					if(read1.fd<0)
-					{
-						printf("open before write failed \n");
-						exit(0);
-					}
-					read1.trace_buf=(char *)malloc(read1.errno);
-					read1.num_bytes=read(read1.fd,read1.trace_buf,read1.errno);
-					if(read1.num_bytes!=read1.errno)
-					{
-						printf("Deviation - read bytes in TRFS call : %d , read bytes in traced call : %d \n",read1.errno,read1.num_bytes);
-						exit(0);
-					}
-					if(read1.buf){
-						if(strncmp(read1.trace_buf,read1.buf,read1.num_bytes)!=0)
-						{
-							printf("Deviation - read content in TRFS call : %s , read content in traced call : %s \n",read1.buf,read1.trace_buf);
-							exit(0);
-						}
-					}
-					printf("No deviation in traced and TRFS call \n");
-					printf("traced system call return value is : %d \n",read1.num_bytes);
-				
-				printf("TRFS call return value is : %d \n ",read1.errno);
-				}
-		
-				if(read1.buf)
-					free(read1.buf);
-				if(read1.trace_buf)
-					free(read1.trace_buf);
-				
-				break;
-				
-			case 'c':
-				printf("record type : close \n");
-				ptr=ptr+sizeof(char);
-				
-				close1.record_id_open=(int)* ptr;
-				printf("corresponding open record_id : %d \n",close1.record_id_open);
-				ptr=ptr+sizeof(int);
-				
-				//lookup for corresponding open
-				for(i=0;i<lookup_index;i++)
-				{
-					if(close1.record_id_open==lookup_arr[i].key)
-					{
-						close1.fd=lookup_arr[i].fd;
-					}
-				}
-				
-				if(mode==mode_default)
-				{
-					if(close1.fd<0)
-						printf("open before write failed \n");
-					else
-					{
-						close1.retval=close(close1.fd);
-						printf("traced system call return value is : %d \n",close1.retval);
-					}
-				}
-				if(mode==mode_s)
-				{
-					
-					if(close1.fd<0)
-					{
-						printf("open before close failed \n");
-						exit(0);
-					}
-					else
-					{
-						close1.retval=close(close1.fd);
-						printf("traced system call return value is : %d \n",close1.retval);
-					}
-					
-				}
-				break;
-				
-			case 'm':
-				
-				printf("record type : Make Directory \n");
-				ptr=ptr+sizeof(char);
-				
-				mkdir1.mode=(unsigned short)*ptr;
-				printf("mode of cretaing directory %hu \n",mkdir1.mode);
-				ptr=ptr+sizeof(unsigned short);
-				
-				mkdir1.path_size=(unsigned short)*ptr;
-				printf("Path size is : %hu \n",mkdir1.path_size);
-				ptr=ptr+sizeof(unsigned short);
-				
-				mkdir1.path=(char *)malloc(sizeof(mkdir1.path_size));
-				strncpy(mkdir1.path,ptr,mkdir1.path_size);
-				printf("path name for mkdir : %s\n",mkdir1.path);
-				ptr=ptr+sizeof(mkdir1.path_size);
-					
-				mkdir1.errno=(int)*ptr;
-				ptr=ptr+sizeof(int);
-				
-				if(mode==mode_default)
-				{
-					
-					mkdir1.retval=mkdir(mkdir1.path,mkdir1.mode);
-					
-					
-					printf("traced system call return value is : %d \n",mkdir1.retval);
-					printf("TRFS call return value is : %d \n ",mkdir1.errno);
-				
-				}
-				if(mode==mode_s)
-				{
-					mkdir1.retval=mkdir(mkdir1.path,mkdir1.mode);
-					if(mkdir1.retval<=0 &&  mkdir1.errno<=0)
-					{
-						if(mkdir1.retval!=mkdir1.errno)
-						{
-						printf("Deviation - return value in TRFS call : %d,return value in traced call %d \n",mkdir1.errno,mkdir1.retval);
-						exit(0);
-						}
-					}
-					
-					
-				}
-				break;
-				
-			case 'R':
-				printf("Record type : Remove Directory \n");
-				ptr=ptr+sizeof(char);
-				
-				rmdir1.path_size=(unsigned short)*ptr;
-				printf("size of rmdir path : %d \n",rmdir1.path_size);
-				ptr=ptr+sizeof(unsigned short);
-				
-				rmdir1.path=(char *)malloc(rmdir1.path_size);
-				strncpy(rmdir1.path,ptr,rmdir1.path_size);
-				printf("path name for rmdir : %s \n",rmdir1.path);
-				ptr=ptr+sizeof(rmdir1.path_size);
-				
-				rmdir1.errno=(int)*ptr;
-				ptr=ptr+sizeof(rmdir1.errno);
-				
-				if(mode==mode_default)
-				{
-					
-					rmdir1.retval=rmdir(rmdir1.path);
-					
-					
-					printf("traced system call return value is  : %d \n",rmdir1.retval);
-					printf("TRFS call return value is : %d \n ",rmdir1.errno);
-				
-				}
-				if(mode==mode_s)
-				{
-					rmdir1.retval=rmdir(rmdir1.path);
-					if(rmdir1.retval<=0 &&  rmdir1.errno<=0)
-					{
-						if(rmdir1.retval!=rmdir1.errno)
-						
-						printf("Deviation -return value in TRFS call : %d,return value in traced call : %d \n",rmdir1.errno,rmdir1.retval);
-					}
-					
-					
-				}
-				break;
-				
-				
-				
-				
-				
-				
-				
-		}
-		
-		
-		
-	 printf("\n");	
-	 if(buffer)
-	 free(buffer); 
-	}
-	close(stream);
-	  return 0;
-}
+#define _GNU_SOURCE	/* fallocate() */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <asm/unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>	/* FICLONERANGE */
+
+#include "treplay.h"
+#include "trctl.h"
+
+#define mode_default 0
+#define mode_n 1
+#define mode_s 2
+
+#define MAX_STREAMS 1024
+#define MAX_OPENS 500
+#define MAX_RECORD 4096
+
+/* kernel-internal "aio queued" result, which iter I/O records can carry */
+#define EIOCBQUEUED 529
+
+/* bytes read or written per call when replaying a splice or iter I/O */
+#define SPLICE_CHUNK 65536
+
+/* room for one getdents64 entry with the longest name */
+#define DIRENT_SIZE (sizeof(linux_dirent64) + 256)
+
+
+/* read the next record of a stream, returns 0 at the end of the stream */
+static int stream_next(trace_stream *s)
+{
+	unsigned short record_size;
+
+	free(s->buffer);
+	s->buffer = NULL;
+	if (read(s->fd, &record_size, sizeof(record_size)) != sizeof(record_size))
+		return 0;
+	if (record_size < sizeof(record_size) + sizeof(int) +
+			  sizeof(unsigned int) + sizeof(char))
+		return 0;
+
+	s->record_size = record_size - sizeof(record_size);
+	s->buffer = (char *)malloc(s->record_size);
+	if (!s->buffer)
+		return 0;
+	if (read(s->fd, s->buffer, s->record_size) != s->record_size)
+		return 0;
+	memcpy(&s->record_id, s->buffer, sizeof(int));
+	return 1;
+}
+
+/* copy a field out of a record and move past it */
+static void get_field(char **ptr, void *dst, size_t size)
+{
+	memcpy(dst, *ptr, size);
+	*ptr += size;
+}
+
+/* a path is recorded as its length followed by the NUL terminated path */
+static char *get_path(char **ptr)
+{
+	unsigned short path_size;
+	char *path;
+
+	get_field(ptr, &path_size, sizeof(path_size));
+	path = *ptr;
+	*ptr += path_size;
+	return path;
+}
+
+/* crc32 as zlib computes it, which is what the kernel records as digest */
+static unsigned int crc32(const char *buf, size_t len)
+{
+	unsigned int crc = ~0u;
+	size_t i;
+	int k;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (unsigned char)buf[i];
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/*
+ * Data of a deduped write record (see trctl.h), resolved into the slot of
+ * @record_id in a ring of the last TRFS_DEDUP_WINDOW records, which the
+ * references of later records are resolved from.
+ */
+static char *get_chunks(char **ptr, unsigned int len, int record_id,
+			dedup_slot **ring)
+{
+	dedup_slot *slot, *from;
+	unsigned int off, n;
+	unsigned char kind;
+	int ref_id;
+	unsigned short index;
+
+	if (!*ring) {
+		*ring = (dedup_slot *)calloc(TRFS_DEDUP_WINDOW, sizeof(dedup_slot));
+		if (!*ring) {
+			printf("out of memory \n");
+			exit(1);
+		}
+		for (n = 0; n < TRFS_DEDUP_WINDOW; n++)
+			(*ring)[n].id = -1;
+	}
+	slot = &(*ring)[record_id % TRFS_DEDUP_WINDOW];
+	slot->id = record_id;
+
+	for (off = 0; off < len && off < MAX_RECORD; off += n) {
+		n = len - off < TRFS_DEDUP_CHUNK ? len - off : TRFS_DEDUP_CHUNK;
+		get_field(ptr, &kind, sizeof(kind));
+		if (kind != TRFS_CHUNK_REF) {
+			get_field(ptr, slot->data + off, n);
+			continue;
+		}
+		get_field(ptr, &ref_id, sizeof(ref_id));
+		get_field(ptr, &index, sizeof(index));
+		from = &(*ring)[ref_id % TRFS_DEDUP_WINDOW];
+		if (from->id != ref_id || (index + 1) * TRFS_DEDUP_CHUNK > MAX_RECORD) {
+			printf("chunk reference to record %d out of the window \n", ref_id);
+			memset(slot->data + off, 0, n);
+			continue;
+		}
+		memmove(slot->data + off, from->data + index * TRFS_DEDUP_CHUNK, n);
+	}
+	return slot->data;
+}
+
+/* fd the open with record id @key was replayed to, -1 if none */
+static int lookup_fd(lookup *arr, int n, int key)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (arr[i].key == key)
+			return arr[i].fd;
+	return -1;
+}
+
+/*
+ * Context @id, growing the table as needed; ids are handed out from 1
+ * up, so they index the table.  Returns NULL when out of memory.
+ */
+static ctx_struct *get_ctx(ctx_struct **ctxs, unsigned int *nr, unsigned int id)
+{
+	ctx_struct *tmp;
+	unsigned int n;
+
+	if (id >= *nr) {
+		n = id < 64 ? 128 : 2 * id;
+		tmp = (ctx_struct *)realloc(*ctxs, n * sizeof(ctx_struct));
+		if (!tmp)
+			return NULL;
+		memset(tmp + *nr, 0, (n - *nr) * sizeof(ctx_struct));
+		*ctxs = tmp;
+		*nr = n;
+	}
+	return &(*ctxs)[id];
+}
+
+/* the kernel records device numbers with new_encode_dev() */
+static dev_t decode_dev(unsigned int dev)
+{
+	return makedev((dev & 0xfff00) >> 8, (dev & 0xff) | ((dev >> 12) & 0xfff00));
+}
+
+/* print replayed and traced results, with -s abort when one failed and the other didn't */
+static void replay_result(int mode, int trfs_ret, int retval)
+{
+	printf("traced system call return value is : %d \n",retval);
+	printf("TRFS call return value is : %d \n ",trfs_ret);
+	if(mode==mode_s)
+	{
+		if((trfs_ret<0)!=(retval<0))
+		{
+			printf("Deviation in TRFS call and traced system call \n");
+			exit(0);
+		}
+		printf("No deviation in traced and TRFS call \n");
+	}
+}
+
+/* index of @path in the table of @n stats, added if it isn't there yet */
+static int cache_stat_index(cache_stat **stats, int *n, const char *path)
+{
+	cache_stat *tmp;
+	int i;
+
+	for (i = 0; i < *n; i++)
+		if (strcmp((*stats)[i].path, path) == 0)
+			return i;
+	tmp = (cache_stat *)realloc(*stats, (*n + 1) * sizeof(cache_stat));
+	if (!tmp || !(tmp[*n].path = strdup(path))) {
+		printf("out of memory \n");
+		exit(1);
+	}
+	tmp[*n].pages = 0;
+	tmp[*n].cached = 0;
+	*stats = tmp;
+	return (*n)++;
+}
+
+/* count a probed read against the file of the open with record id @key */
+static void cache_account(cache_stat *files, open_file *opens, int nr_opens,
+			  int key, unsigned int pages, unsigned int cached)
+{
+	int i;
+
+	if (!pages)
+		return;
+	for (i = nr_opens - 1; i >= 0; i--) {
+		if (opens[i].key == key) {
+			files[opens[i].file].pages += pages;
+			files[opens[i].file].cached += cached;
+			return;
+		}
+	}
+}
+
+/* page cache hit ratios of the reads, per file and per directory */
+static void cache_report(cache_stat *files, int nr_files)
+{
+	cache_stat *dirs = NULL;
+	int nr_dirs = 0, i, d;
+	char *slash;
+
+	printf("page cache hits per file (cached / pages read) : \n");
+	for (i = 0; i < nr_files; i++) {
+		if (!files[i].pages)
+			continue;
+		printf("%s : %llu / %llu (%.1f%%) \n", files[i].path, files[i].cached, files[i].pages,
+		       100.0 * files[i].cached / files[i].pages);
+		slash = strrchr(files[i].path, '/');
+		if (slash)
+			*slash = '\0';
+		d = cache_stat_index(&dirs, &nr_dirs, slash ? (slash == files[i].path ? "/" : files[i].path) : ".");
+		if (slash)
+			*slash = '/';
+		dirs[d].pages += files[i].pages;
+		dirs[d].cached += files[i].cached;
+	}
+	printf("page cache hits per directory : \n");
+	for (i = 0; i < nr_dirs; i++) {
+		printf("%s : %llu / %llu (%.1f%%) \n", dirs[i].path, dirs[i].cached, dirs[i].pages,
+		       100.0 * dirs[i].cached / dirs[i].pages);
+		free(dirs[i].path);
+	}
+	free(dirs);
+}
+
+/* binary min-heap of streams ordered by the record id of their current record */
+static void heap_sift_down(trace_stream **heap, int n, int i)
+{
+	int l, r, min;
+	trace_stream *tmp;
+
+	while (1) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if (l < n && heap[l]->record_id < heap[min]->record_id)
+			min = l;
+		if (r < n && heap[r]->record_id < heap[min]->record_id)
+			min = r;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/*
+ * open a tfile; a per-cpu or per-node mount writes TFILE.0 ... TFILE.n,
+ * so when TFILE itself does not exist all of its numbered streams are used
+ */
+static int open_streams(char *filename, trace_stream *streams, int nr)
+{
+	char name[4096];
+	int fd, i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd >= 0) {
+		if (nr < MAX_STREAMS)
+			streams[nr++].fd = fd;
+		return nr;
+	}
+
+	for (i = 0; nr < MAX_STREAMS; i++) {
+		snprintf(name, sizeof(name), "%s.%d", filename, i);
+		fd = open(name, O_RDONLY);
+		if (fd < 0)
+			break;
+		streams[nr++].fd = fd;
+	}
+	return nr;
+}
+
+
+int main(int argc, char *argv[])
+{
+   trace_stream *streams;
+   trace_stream **heap;
+   trace_stream *cur;
+   int nr_streams=0, heap_size=0;
+   char *buffer;
+   int c;
+   char * filename;
+   char *ptr;
+   
+
+	unsigned short record_size=0;
+	int record_id=0;
+	char record_type;
+	int mode=mode_default;
+	lookup lookup_arr[MAX_OPENS];
+	int positional=0;
+	int summary=0;
+	unsigned int ctx_id;
+	ctx_struct *ctxs=NULL, *ctx;
+	unsigned int nr_ctxs=0;
+	open_struct open1;
+	write_struct write1;
+	read_struct read1;
+	close_struct close1;
+	mkdir_struct mkdir1;
+	rmdir_struct rmdir1;
+	ns_struct ns1;
+	attr_struct at1;
+	sync_struct sync1;
+	dir_struct dir1;
+	range_struct range1;
+	splice_struct splice1;
+	copy_struct copy1;
+	fault_struct fault1;
+	checkpoint_struct cp1;
+	cache_stat *cache_files=NULL;
+	open_file *cache_opens=NULL;
+	int nr_cache_files=0, nr_cache_opens=0;
+	dedup_slot *dedup_ring=NULL;
+	struct timespec ts[2];
+	char *xbuf;
+	char ch;
+	int lookup_index=0;
+	int i;
+	
+	//getopt for parsing -s or -n option
+	while ((c = getopt (argc, argv, "nspc")) != -1)
+    switch (c)
+      {
+      case 'c':
+        summary=1;
+        break;
+      case 'p':
+        positional=1;
+        break;
+      case 'n':
+	  if(mode==mode_s)
+	  {
+		  printf("options -n or -s not -n and -s \n");
+		  exit(0);
+	  }
+        mode=mode_n;
+        break;
+      case 's':
+        if(mode==mode_n)
+		{
+			printf("options -n or -s not -n and -s \n");
+			exit(0);
+		}
+		mode=mode_s;
+        break;
+	  
+	  case '?':
+		printf("Usage : ./treplay [-nspc] TFILE... \n");
+        return 1;
+      
+	  default:
+		printf("mode not specified");
+        abort ();
+      }
+	  if(optind >= argc)
+	  {
+		  printf("Usage : ./treplay [-nspc] TFILE... \n");
+		  exit(1);	
+	  }
+	  
+	  streams=(trace_stream *)calloc(MAX_STREAMS,sizeof(trace_stream));
+	  heap=(trace_stream **)calloc(MAX_STREAMS,sizeof(trace_stream *));
+	  for(i=optind;i<argc;i++)
+	  {
+		  filename=argv[i];
+		  c=nr_streams;
+		  nr_streams=open_streams(filename,streams,nr_streams);
+		  if(nr_streams==c)
+		  {
+			  printf("Error in opening file %s \n",filename);
+			  exit(0);
+		  }
+	  }
+	  
+	//priming every stream with its first record and heapifying on record id
+	for(i=0;i<nr_streams;i++)
+	{
+		if(stream_next(&streams[i]))
+			heap[heap_size++]=&streams[i];
+	}
+	for(i=heap_size/2-1;i>=0;i--)
+		heap_sift_down(heap,heap_size,i);
+	
+	while(heap_size>0)
+	{	
+		cur=heap[0];
+		record_size=cur->record_size;
+		printf("record size : %d \n",record_size+2);
+		
+		//getting a single record into buffer
+		buffer=cur->buffer;
+		ptr=buffer; 
+		
+		//obtaining record_id
+		record_id=cur->record_id;
+		ptr=ptr+sizeof(int);
+		printf("record id is : %d \n",record_id);
+		
+		//context id of the task that made the call, defined by an earlier 'D' record
+		get_field(&ptr,&ctx_id,sizeof(ctx_id));
+		ctx=get_ctx(&ctxs,&nr_ctxs,ctx_id);
+		if(ctx)
+		{
+			ctx->records++;
+			printf("context : %u (%s, pid %d) \n",ctx_id,ctx->comm,ctx->pid);
+		}
+		
+		record_type=(int)*ptr;//record_type from buffer
+		
+		
+		
+		switch(record_type){
+			case 'D':
+				printf("record type : context definition \n");
+				ptr=ptr+sizeof(char);
+				
+				if(ctx)
+				{
+					get_field(&ptr,&ctx->pid,sizeof(ctx->pid));
+					get_field(&ptr,&ctx->tgid,sizeof(ctx->tgid));
+					get_field(&ptr,&ctx->uid,sizeof(ctx->uid));
+					get_field(&ptr,&ctx->cgroup,sizeof(ctx->cgroup));
+					get_field(&ptr,ctx->comm,TASK_COMM_LEN);
+					ctx->comm[TASK_COMM_LEN]='\0';
+					ctx->records--; // not a call of its own
+					printf("pid : %d, tgid : %d, uid : %u, cgroup : %llu, comm : %s \n",ctx->pid,ctx->tgid,ctx->uid,ctx->cgroup,ctx->comm);
+				}
+				break;
+				
+			case 'o':
+				
+				printf("record type : open \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&open1.flags,sizeof(open1.flags));
+				printf("flags : %d \n",open1.flags);
+				get_field(&ptr,&open1.mode,sizeof(open1.mode));
+				printf("mode is: %hu \n",open1.mode);
+				open1.pathname=get_path(&ptr);
+				printf("path is : %s \n", open1.pathname);
+				get_field(&ptr,&open1.errno,sizeof(open1.errno));
+				
+				/* remember which file the open is for, reads are counted against it */
+				if(summary && open1.errno>=0)
+				{
+					open_file *tmp=(open_file *)realloc(cache_opens,(nr_cache_opens+1)*sizeof(open_file));
+					if(!tmp)
+					{
+						printf("out of memory \n");
+						exit(1);
+					}
+					cache_opens=tmp;
+					cache_opens[nr_cache_opens].key=record_id;
+					cache_opens[nr_cache_opens].file=cache_stat_index(&cache_files,&nr_cache_files,open1.pathname);
+					nr_cache_opens++;
+				}
+				
+				if(mode==mode_n)
+					break;
+				
+				/* pwrite on an O_APPEND fd appends, ignoring the offset */
+				if(positional)
+					open1.flags&=~O_APPEND;
+				open1.retval=open(open1.pathname,open1.flags,open1.mode);
+				replay_result(mode,open1.errno,open1.retval);
+				
+				if(lookup_index<MAX_OPENS)
+				{
+					lookup_arr[lookup_index].key=record_id;//record_is used as key for lookup 
+					lookup_arr[lookup_index].fd=open1.retval;//fd to be used for corresponding read and write calls
+					lookup_index++;
+				}
+				break;
+			
+			case 'W':
+			case 'w':
+				
+				printf("record type : write%s\n",record_type=='W' ? " (deduped)" : "");
+				ptr=ptr+sizeof(char);
+				
+				//to lookup the corresponding open
+				get_field(&ptr,&write1.record_id_open,sizeof(write1.record_id_open));
+				printf("corresponding open record_id : %d \n", write1.record_id_open);
+				get_field(&ptr,&write1.offset,sizeof(write1.offset));
+				printf("offset : %lld \n",write1.offset);
+				
+				//number of bytes to be written as entered by user
+				get_field(&ptr,&write1.count,sizeof(write1.count));
+				printf("number of bytes to be written : %zu \n",write1.count);
+				
+				//only the first bytes may have been kept, see payload_cap
+				get_field(&ptr,&write1.stored,sizeof(write1.stored));
+				get_field(&ptr,&write1.digest,sizeof(write1.digest));
+				write1.no_data=write1.stored==TRFS_PAYLOAD_NONE;
+				if(write1.no_data)
+					write1.stored=0;
+				if(record_type=='W')
+					write1.data=get_chunks(&ptr,write1.stored,record_id,&dedup_ring);
+				else
+				{
+					write1.data=ptr;
+					ptr=ptr+write1.stored;
+				}
+				if(write1.no_data)
+					printf("content in the write buffer : not captured \n");
+				else
+					printf("content in the write buffer (%u bytes kept, crc32 0x%08x) : %.*s \n",write1.stored,write1.digest,(int)write1.stored,write1.data);
+				
+				if(mode!=mode_n)
+				{
+					/* bytes that weren't kept are made up as zeros */
+					write1.buf=(char *)calloc(1,write1.count ? write1.count : 1);
+					if(!write1.buf)
+					{
+						printf("out of memory \n");
+						exit(1);
+					}
+					memcpy(write1.buf,write1.data,write1.stored<write1.count ? write1.stored : write1.count);
+				}
+				
+				//return value from trfs_write
+				get_field(&ptr,&write1.errno,sizeof(write1.errno));
+				
+				if(mode==mode_n)
+					break;
+				
+				write1.fd=lookup_fd(lookup_arr,lookup_index,write1.record_id_open);
+				if(write1.fd<0)
+				{
+					printf("open before write failed \n");
+					if(mode==mode_s)
+						exit(0);
+					free(write1.buf);
+					break;
+				}
+				
+				if(positional)
+					write1.num_bytes=pwrite(write1.fd,write1.buf,write1.count,write1.offset);
+				else
+					write1.num_bytes=write(write1.fd,write1.buf,write1.count);
+				if(mode==mode_s && write1.errno>=0 && write1.num_bytes!=write1.errno)
+				{
+					printf("Deviation - written bytes in TRFS call : %d , written bytes in traced call : %d \n",write1.errno,write1.num_bytes);
+					exit(0);
+				}
+				replay_result(mode,write1.errno,write1.num_bytes);
+				free(write1.buf);
+				break;
+			
+			case 'r':
+				
+				printf("record type : read \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&read1.record_id_open,sizeof(read1.record_id_open));
+				printf("corresponding open record_id : %d \n",read1.record_id_open);
+				get_field(&ptr,&read1.offset,sizeof(read1.offset));
+				printf("offset : %lld \n",read1.offset);
+				
+				//bytes to be read as entered by the user
+				get_field(&ptr,&read1.user_bytes,sizeof(read1.user_bytes));
+				printf("number of bytes entered by user : %zu \n",read1.user_bytes);
+				
+				//return value from trfs_read
+				get_field(&ptr,&read1.errno,sizeof(read1.errno));
+				printf("number of bytes read : %d \n",read1.errno);
+				
+				//pages of the range in the lower page cache before the read
+				get_field(&ptr,&read1.pages,sizeof(read1.pages));
+				get_field(&ptr,&read1.cached,sizeof(read1.cached));
+				if(read1.pages)
+					printf("pages cached : %u of %u \n",read1.cached,read1.pages);
+				if(summary)
+					cache_account(cache_files,cache_opens,nr_cache_opens,read1.record_id_open,read1.pages,read1.cached);
+				
+				//content read at trfs level, maybe only its first bytes
+				get_field(&ptr,&read1.stored,sizeof(read1.stored));
+				get_field(&ptr,&read1.digest,sizeof(read1.digest));
+				read1.no_data=read1.stored==TRFS_PAYLOAD_NONE;
+				if(read1.no_data)
+				{
+					read1.stored=0;
+					printf("content read to buffer : not captured \n");
+				}
+				read1.buf=ptr;
+				if(!read1.no_data)
+					printf("content read to buffer (%u bytes kept, crc32 0x%08x) : %.*s \n ",read1.stored,read1.digest,(int)read1.stored,read1.buf);
+				
+				if(mode==mode_n)
+					break;
+				
+				read1.fd=lookup_fd(lookup_arr,lookup_index,read1.record_id_open);
+				if(read1.fd<0)
+				{
+					printf("open before read failed \n");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				
+				read1.trace_buf=(char *)malloc(read1.user_bytes ? read1.user_bytes : 1);
+				if(!read1.trace_buf)
+				{
+					printf("out of memory \n");
+					exit(1);
+				}
+				if(positional)
+					read1.num_bytes=pread(read1.fd,read1.trace_buf,read1.user_bytes,read1.offset);
+				else
+					read1.num_bytes=read(read1.fd,read1.trace_buf,read1.user_bytes);
+				if(mode==mode_s && read1.errno>=0)
+				{
+					if(read1.num_bytes!=read1.errno)
+					{
+						printf("Deviation - read bytes in TRFS call : %d , read bytes in traced call : %d \n",read1.errno,read1.num_bytes);
+						exit(0);
+					}
+					if(!read1.no_data &&
+					   (memcmp(read1.trace_buf,read1.buf,read1.stored)!=0 ||
+					    crc32(read1.trace_buf,read1.num_bytes)!=read1.digest))
+					{
+						printf("Deviation - read content in TRFS call : %.*s , read content in traced call : %.*s \n",(int)read1.stored,read1.buf,read1.num_bytes,read1.trace_buf);
+						exit(0);
+					}
+				}
+				replay_result(mode,read1.errno,read1.num_bytes);
+				free(read1.trace_buf);
+				break;
+				
+			case 'Q':
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&range1.record_id_open,sizeof(range1.record_id_open));
+				get_field(&ptr,&range1.type,sizeof(range1.type));
+				get_field(&ptr,&range1.offset,sizeof(range1.offset));
+				get_field(&ptr,&range1.bytes,sizeof(range1.bytes));
+				get_field(&ptr,&range1.ops,sizeof(range1.ops));
+				get_field(&ptr,&range1.first_ns,sizeof(range1.first_ns));
+				get_field(&ptr,&range1.last_ns,sizeof(range1.last_ns));
+				get_field(&ptr,&range1.pages,sizeof(range1.pages));
+				get_field(&ptr,&range1.cached,sizeof(range1.cached));
+				printf("record type : coalesced %s \n",range1.type=='w' ? "writes" : "reads");
+				printf("corresponding open record_id : %d \n",range1.record_id_open);
+				printf("offset : %lld, bytes : %llu, calls : %u, over %llu ns \n",range1.offset,range1.bytes,range1.ops,range1.last_ns-range1.first_ns);
+				if(range1.pages)
+					printf("pages cached : %u of %u \n",range1.cached,range1.pages);
+				if(summary)
+					cache_account(cache_files,cache_opens,nr_cache_opens,range1.record_id_open,range1.pages,range1.cached);
+				
+				if(mode==mode_n || !range1.ops)
+					break;
+				range1.fd=lookup_fd(lookup_arr,lookup_index,range1.record_id_open);
+				if(range1.fd<0)
+				{
+					printf("open before %s failed \n",range1.type=='w' ? "write" : "read");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				
+				/* the same number of calls over the range; written data isn't traced, so zeros are written */
+				range1.chunk=(range1.bytes+range1.ops-1)/range1.ops;
+				range1.buf=(char *)calloc(1,range1.chunk ? range1.chunk : 1);
+				if(!range1.buf)
+				{
+					printf("out of memory \n");
+					exit(1);
+				}
+				range1.retval=0;
+				for(range1.done=0;range1.done<range1.bytes;range1.done+=range1.chunk)
+				{
+					size_t n=range1.bytes-range1.done<range1.chunk ? range1.bytes-range1.done : range1.chunk;
+					ssize_t ret;
+					
+					if(range1.type=='w')
+						ret=pwrite(range1.fd,range1.buf,n,range1.offset+range1.done);
+					else
+						ret=pread(range1.fd,range1.buf,n,range1.offset+range1.done);
+					if(ret<0)
+					{
+						range1.retval=-1;
+						break;
+					}
+				}
+				free(range1.buf);
+				replay_result(mode,0,range1.retval);
+				break;
+				
+			case 'P':
+			case 'v':
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&splice1.record_id_open,sizeof(splice1.record_id_open));
+				get_field(&ptr,&splice1.type,sizeof(splice1.type));
+				get_field(&ptr,&splice1.offset,sizeof(splice1.offset));
+				get_field(&ptr,&splice1.len,sizeof(splice1.len));
+				get_field(&ptr,&splice1.result,sizeof(splice1.result));
+				get_field(&ptr,&splice1.pages,sizeof(splice1.pages));
+				get_field(&ptr,&splice1.cached,sizeof(splice1.cached));
+				printf("record type : %s %s \n",record_type=='P' ? "splice" : "iter",splice1.type=='w' ? "write" : "read");
+				printf("corresponding open record_id : %d \n",splice1.record_id_open);
+				printf("offset : %lld, length : %llu, result : %lld \n",splice1.offset,splice1.len,splice1.result);
+				if(splice1.pages)
+					printf("pages cached : %u of %u \n",splice1.cached,splice1.pages);
+				if(summary)
+					cache_account(cache_files,cache_opens,nr_cache_opens,splice1.record_id_open,splice1.pages,splice1.cached);
+				/* aio the lower fs queued, its result never came back through trfs */
+				if(splice1.result==-EIOCBQUEUED)
+				{
+					printf("queued asynchronously \n");
+					splice1.result=splice1.len;
+				}
+				
+				if(mode==mode_n)
+					break;
+				splice1.fd=lookup_fd(lookup_arr,lookup_index,splice1.record_id_open);
+				if(splice1.fd<0)
+				{
+					printf("open before %s failed \n",record_type=='P' ? "splice" : "iter I/O");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				
+				/*
+				 * no data is traced, so the range is replayed with plain reads, or writes
+				 * of zeros, leaving the file offset where the call did; the buffer is
+				 * page aligned in case the open was O_DIRECT
+				 */
+				if(posix_memalign((void **)&splice1.buf,4096,SPLICE_CHUNK))
+				{
+					printf("out of memory \n");
+					exit(1);
+				}
+				memset(splice1.buf,0,SPLICE_CHUNK);
+				splice1.len=splice1.type=='w' && splice1.result>0 ? splice1.result : splice1.len;
+				splice1.retval=lseek(splice1.fd,splice1.offset,SEEK_SET)<0 ? -1 : 0;
+				for(splice1.done=0;!splice1.retval && splice1.done<splice1.len;)
+				{
+					unsigned long long left=splice1.len-splice1.done;
+					size_t n=left<SPLICE_CHUNK ? left : SPLICE_CHUNK;
+					ssize_t ret;
+					
+					if(splice1.type=='w')
+						ret=write(splice1.fd,splice1.buf,n);
+					else
+						ret=read(splice1.fd,splice1.buf,n);
+					if(ret<0)
+						splice1.retval=-1;
+					if(ret<=0)
+						break;
+					splice1.done+=ret;
+				}
+				free(splice1.buf);
+				replay_result(mode,splice1.result<0 ? (int)splice1.result : 0,splice1.retval);
+				break;
+				
+			case 'y':
+			case 'L':
+				printf("record type : %s \n",record_type=='y' ? "copy_file_range" : "clone");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&copy1.record_id_in,sizeof(copy1.record_id_in));
+				get_field(&ptr,&copy1.pos_in,sizeof(copy1.pos_in));
+				get_field(&ptr,&copy1.record_id_out,sizeof(copy1.record_id_out));
+				get_field(&ptr,&copy1.pos_out,sizeof(copy1.pos_out));
+				get_field(&ptr,&copy1.len,sizeof(copy1.len));
+				get_field(&ptr,&copy1.result,sizeof(copy1.result));
+				printf("source open record_id : %d, offset : %lld \n",copy1.record_id_in,copy1.pos_in);
+				printf("target open record_id : %d, offset : %lld \n",copy1.record_id_out,copy1.pos_out);
+				printf("length : %llu, result : %lld \n",copy1.len,copy1.result);
+				
+				if(mode==mode_n)
+					break;
+				copy1.fd_in=lookup_fd(lookup_arr,lookup_index,copy1.record_id_in);
+				copy1.fd_out=lookup_fd(lookup_arr,lookup_index,copy1.record_id_out);
+				if(copy1.fd_in<0 || copy1.fd_out<0)
+				{
+					printf("open before %s failed \n",record_type=='y' ? "copy" : "clone");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				/* the offsets are passed explicitly, so neither file offset moves */
+				if(record_type=='y')
+				{
+#ifdef SYS_copy_file_range
+					copy1.retval=syscall(SYS_copy_file_range,copy1.fd_in,&copy1.pos_in,
+							     copy1.fd_out,&copy1.pos_out,(size_t)copy1.len,0)<0 ? -1 : 0;
+#else
+					printf("copy_file_range not supported here \n");
+					copy1.retval=-1;
+#endif
+				}
+				else
+				{
+#ifdef FICLONERANGE
+					struct file_clone_range fcr;
+					
+					fcr.src_fd=copy1.fd_in;
+					fcr.src_offset=copy1.pos_in;
+					fcr.src_length=copy1.len;
+					fcr.dest_offset=copy1.pos_out;
+					copy1.retval=ioctl(copy1.fd_out,FICLONERANGE,&fcr);
+#else
+					printf("clone not supported here \n");
+					copy1.retval=-1;
+#endif
+				}
+				replay_result(mode,copy1.result<0 ? (int)copy1.result : 0,copy1.retval);
+				break;
+				
+			case 'c':
+				printf("record type : close \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&close1.record_id_open,sizeof(close1.record_id_open));
+				printf("corresponding open record_id : %d \n",close1.record_id_open);
+				
+				if(mode==mode_n)
+					break;
+				
+				//lookup for corresponding open
+				close1.fd=lookup_fd(lookup_arr,lookup_index,close1.record_id_open);
+				if(close1.fd<0)
+				{
+					printf("open before close failed \n");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				close1.retval=close(close1.fd);
+				printf("traced system call return value is : %d \n",close1.retval);
+				break;
+				
+			case 'm':
+				
+				printf("record type : Make Directory \n");
+				ptr=ptr+sizeof(char);
+				
+				mkdir1.mode=(unsigned short)*ptr;
+				printf("mode of cretaing directory %hu \n",mkdir1.mode);
+				ptr=ptr+sizeof(unsigned short);
+				
+				mkdir1.path_size=(unsigned short)*ptr;
+				printf("Path size is : %hu \n",mkdir1.path_size);
+				ptr=ptr+sizeof(unsigned short);
+				
+				mkdir1.path=(char *)malloc(sizeof(mkdir1.path_size));
+				strncpy(mkdir1.path,ptr,mkdir1.path_size);
+				printf("path name for mkdir : %s\n",mkdir1.path);
+				ptr=ptr+sizeof(mkdir1.path_size);
+					
+				mkdir1.errno=(int)*ptr;
+				ptr=ptr+sizeof(int);
+				
+				if(mode==mode_default)
+				{
+					
+					mkdir1.retval=mkdir(mkdir1.path,mkdir1.mode);
+					
+					
+					printf("traced system call return value is : %d \n",mkdir1.retval);
+					printf("TRFS call return value is : %d \n ",mkdir1.errno);
+				
+				}
+				if(mode==mode_s)
+				{
+					mkdir1.retval=mkdir(mkdir1.path,mkdir1.mode);
+					if(mkdir1.retval<=0 &&  mkdir1.errno<=0)
+					{
+						if(mkdir1.retval!=mkdir1.errno)
+						{
+						printf("Deviation - return value in TRFS call : %d,return value in traced call %d \n",mkdir1.errno,mkdir1.retval);
+						exit(0);
+						}
+					}
+					
+					
+				}
+				break;
+				
+			case 'R':
+				printf("Record type : Remove Directory \n");
+				ptr=ptr+sizeof(char);
+				
+				rmdir1.path_size=(unsigned short)*ptr;
+				printf("size of rmdir path : %d \n",rmdir1.path_size);
+				ptr=ptr+sizeof(unsigned short);
+				
+				rmdir1.path=(char *)malloc(rmdir1.path_size);
+				strncpy(rmdir1.path,ptr,rmdir1.path_size);
+				printf("path name for rmdir : %s \n",rmdir1.path);
+				ptr=ptr+sizeof(rmdir1.path_size);
+				
+				rmdir1.errno=(int)*ptr;
+				ptr=ptr+sizeof(rmdir1.errno);
+				
+				if(mode==mode_default)
+				{
+					
+					rmdir1.retval=rmdir(rmdir1.path);
+					
+					
+					printf("traced system call return value is  : %d \n",rmdir1.retval);
+					printf("TRFS call return value is : %d \n ",rmdir1.errno);
+				
+				}
+				if(mode==mode_s)
+				{
+					rmdir1.retval=rmdir(rmdir1.path);
+					if(rmdir1.retval<=0 &&  rmdir1.errno<=0)
+					{
+						if(rmdir1.retval!=rmdir1.errno)
+						
+						printf("Deviation -return value in TRFS call : %d,return value in traced call : %d \n",rmdir1.errno,rmdir1.retval);
+					}
+					
+					
+				}
+				break;
+				
+				
+				
+				
+				
+				
+				
+			case 'C':
+				printf("record type : create \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&ns1.mode,sizeof(ns1.mode));
+				printf("mode is : %hu \n",ns1.mode);
+				ns1.path=get_path(&ptr);
+				printf("path is : %s \n",ns1.path);
+				get_field(&ptr,&ns1.err,sizeof(ns1.err));
+				
+				//the open record that follows has no O_CREAT, so create the file here
+				if(mode!=mode_n)
+				{
+					ns1.retval=open(ns1.path,O_CREAT|O_EXCL|O_WRONLY,ns1.mode);
+					if(ns1.retval>=0)
+						ns1.retval=close(ns1.retval);
+					replay_result(mode,ns1.err,ns1.retval);
+				}
+				break;
+				
+			case 'u':
+				printf("record type : unlink \n");
+				ptr=ptr+sizeof(char);
+				
+				ns1.path=get_path(&ptr);
+				printf("path is : %s \n",ns1.path);
+				get_field(&ptr,&ns1.err,sizeof(ns1.err));
+				
+				if(mode!=mode_n)
+				{
+					ns1.retval=unlink(ns1.path);
+					replay_result(mode,ns1.err,ns1.retval);
+				}
+				break;
+				
+			case 'N':
+			case 'l':
+				printf("record type : %s \n",record_type=='N' ? "rename" : "link");
+				ptr=ptr+sizeof(char);
+				
+				ns1.path=get_path(&ptr);
+				printf("old path is : %s \n",ns1.path);
+				ns1.path2=get_path(&ptr);
+				printf("new path is : %s \n",ns1.path2);
+				get_field(&ptr,&ns1.err,sizeof(ns1.err));
+				
+				if(mode!=mode_n)
+				{
+					if(record_type=='N')
+						ns1.retval=rename(ns1.path,ns1.path2);
+					else
+						ns1.retval=link(ns1.path,ns1.path2);
+					replay_result(mode,ns1.err,ns1.retval);
+				}
+				break;
+				
+			case 's':
+				printf("record type : symlink \n");
+				ptr=ptr+sizeof(char);
+				
+				ns1.path2=get_path(&ptr);
+				printf("link target is : %s \n",ns1.path2);
+				ns1.path=get_path(&ptr);
+				printf("path is : %s \n",ns1.path);
+				get_field(&ptr,&ns1.err,sizeof(ns1.err));
+				
+				if(mode!=mode_n)
+				{
+					ns1.retval=symlink(ns1.path2,ns1.path);
+					replay_result(mode,ns1.err,ns1.retval);
+				}
+				break;
+				
+			case 'K':
+				printf("record type : mknod \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&ns1.mode,sizeof(ns1.mode));
+				printf("mode is : %hu \n",ns1.mode);
+				get_field(&ptr,&ns1.dev,sizeof(ns1.dev));
+				printf("device is : 0x%x \n",ns1.dev);
+				ns1.path=get_path(&ptr);
+				printf("path is : %s \n",ns1.path);
+				get_field(&ptr,&ns1.err,sizeof(ns1.err));
+				
+				if(mode!=mode_n)
+				{
+					ns1.retval=mknod(ns1.path,ns1.mode,decode_dev(ns1.dev));
+					replay_result(mode,ns1.err,ns1.retval);
+				}
+				break;
+				
+			case 'f':
+			case 'F':
+			case 'S':
+			case 'a':
+				ptr=ptr+sizeof(char);
+				get_field(&ptr,&sync1.record_id_open,sizeof(sync1.record_id_open));
+				sync1.fd=lookup_fd(lookup_arr,lookup_index,sync1.record_id_open);
+				
+				switch(record_type)
+				{
+					case 'f':
+						printf("record type : fsync \n");
+						get_field(&ptr,&sync1.start,sizeof(sync1.start));
+						get_field(&ptr,&sync1.end,sizeof(sync1.end));
+						get_field(&ptr,&sync1.flag,sizeof(sync1.flag));
+						get_field(&ptr,&sync1.err,sizeof(sync1.err));
+						printf("range : %lld - %lld, datasync : %d \n",sync1.start,sync1.end,sync1.flag);
+						break;
+					case 'F':
+						printf("record type : flush \n");
+						get_field(&ptr,&sync1.err,sizeof(sync1.err));
+						break;
+					case 'S':
+						printf("record type : llseek \n");
+						get_field(&ptr,&sync1.flag,sizeof(sync1.flag));
+						get_field(&ptr,&sync1.start,sizeof(sync1.start));
+						get_field(&ptr,&sync1.end,sizeof(sync1.end));
+						/* llseek records the resulting offset, or the error */
+						sync1.err=sync1.end<0 ? (int)sync1.end : 0;
+						printf("offset : %lld, whence : %d, new position : %lld \n",sync1.start,sync1.flag,sync1.end);
+						break;
+					default:
+						printf("record type : fallocate \n");
+						get_field(&ptr,&sync1.flag,sizeof(sync1.flag));
+						get_field(&ptr,&sync1.start,sizeof(sync1.start));
+						get_field(&ptr,&sync1.end,sizeof(sync1.end));
+						get_field(&ptr,&sync1.err,sizeof(sync1.err));
+						printf("mode : 0x%x, offset : %lld, length : %lld \n",sync1.flag,sync1.start,sync1.end);
+						break;
+				}
+				printf("corresponding open record_id : %d \n",sync1.record_id_open);
+				
+				if(mode==mode_n)
+					break;
+				if(sync1.fd<0)
+				{
+					printf("open before %s failed \n",record_type=='S' ? "llseek" : "sync");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				switch(record_type)
+				{
+					case 'f':
+						/* no ranged fsync in user space, the whole file is a superset barrier */
+						sync1.retval=sync1.flag ? fdatasync(sync1.fd) : fsync(sync1.fd);
+						break;
+					case 'F':
+						/* flush only happens on close(), which its own record replays */
+						sync1.retval=sync1.err;
+						break;
+					case 'S':
+						sync1.retval=lseek(sync1.fd,sync1.start,sync1.flag)<0 ? -1 : 0;
+						break;
+					default:
+						sync1.retval=fallocate(sync1.fd,sync1.flag,sync1.start,sync1.end);
+						break;
+				}
+				replay_result(mode,sync1.err,sync1.retval);
+				break;
+				
+			case 'h':
+				printf("record type : readahead window \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&sync1.record_id_open,sizeof(sync1.record_id_open));
+				get_field(&ptr,&sync1.start,sizeof(sync1.start));
+				get_field(&ptr,&sync1.end,sizeof(sync1.end));
+				printf("corresponding open record_id : %d \n",sync1.record_id_open);
+				printf("offset : %lld, length : %lld \n",sync1.start,sync1.end);
+				
+				/*
+				 * not a syscall: the window trfs read ahead for a fadvise, readahead(2)
+				 * or madvise, which can't be told apart and have no traced result;
+				 * the same window is read ahead again, its result isn't compared
+				 */
+				if(mode==mode_n)
+					break;
+				sync1.fd=lookup_fd(lookup_arr,lookup_index,sync1.record_id_open);
+				if(sync1.fd>=0)
+				{
+					sync1.retval=readahead(sync1.fd,sync1.start,sync1.end);
+					printf("window read ahead again, result : %d \n",sync1.retval);
+				}
+				break;
+				
+			case 'g':
+				printf("record type : readdir \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&dir1.record_id_open,sizeof(dir1.record_id_open));
+				get_field(&ptr,&dir1.entries,sizeof(dir1.entries));
+				get_field(&ptr,&dir1.start,sizeof(dir1.start));
+				get_field(&ptr,&dir1.end,sizeof(dir1.end));
+				get_field(&ptr,&dir1.err,sizeof(dir1.err));
+				printf("corresponding open record_id : %d \n",dir1.record_id_open);
+				printf("entries returned : %u, position : %lld -> %lld \n",dir1.entries,dir1.start,dir1.end);
+				
+				if(mode==mode_n)
+					break;
+				dir1.fd=lookup_fd(lookup_arr,lookup_index,dir1.record_id_open);
+				if(dir1.fd<0)
+				{
+					printf("open before readdir failed \n");
+					if(mode==mode_s)
+						exit(0);
+					break;
+				}
+				/* one getdents64 with room for as many entries as were traced */
+				dir1.size=(dir1.entries ? dir1.entries : 1)*DIRENT_SIZE;
+				dir1.buf=(char *)malloc(dir1.size);
+				if(!dir1.buf)
+				{
+					printf("out of memory \n");
+					exit(1);
+				}
+				dir1.retval=syscall(SYS_getdents64,dir1.fd,dir1.buf,dir1.size);
+				if(dir1.retval>0)
+				{
+					unsigned int n=0;
+					long off;
+					linux_dirent64 *d;
+					
+					for(off=0;off<dir1.retval;off+=d->d_reclen,n++)
+						d=(linux_dirent64 *)(dir1.buf+off);
+					printf("entries replayed : %u \n",n);
+					dir1.retval=0;
+				}
+				free(dir1.buf);
+				replay_result(mode,dir1.err,dir1.retval);
+				break;
+				
+			case 'k':
+				printf("record type : lookup \n");
+				ptr=ptr+sizeof(char);
+				
+				at1.path=get_path(&ptr);
+				get_field(&ptr,&at1.err,sizeof(at1.err));
+				printf("path is : %s (%s) \n",at1.path,at1.err==0 ? "hit" : at1.err==-2 ? "negative" : "error");
+				
+				if(mode!=mode_n)
+				{
+					/* a lookup is what a stat of the path costs */
+					struct stat st;
+					at1.retval=lstat(at1.path,&st);
+					replay_result(mode,at1.err,at1.retval);
+				}
+				break;
+				
+			case 'Z':
+				printf("record type : checkpoint \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&cp1.reason,sizeof(cp1.reason));
+				get_field(&ptr,&cp1.time_ns,sizeof(cp1.time_ns));
+				printf("%s at %llu.%09llu \n",cp1.reason=='f' ? "freeze" : cp1.reason=='u' ? "unfreeze" : "sync",
+					cp1.time_ns/1000000000ULL,cp1.time_ns%1000000000ULL);
+				
+				/* the records before it were durable at this point; freezes aren't replayed */
+				if(mode!=mode_n && cp1.reason=='s')
+				{
+					sync();
+					replay_result(mode,0,0);
+				}
+				break;
+				
+			case 'M':
+				printf("record type : mmap fault \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&fault1.record_id_open,sizeof(fault1.record_id_open));
+				get_field(&ptr,&fault1.offset,sizeof(fault1.offset));
+				get_field(&ptr,&fault1.kind,sizeof(fault1.kind));
+				get_field(&ptr,&fault1.major,sizeof(fault1.major));
+				get_field(&ptr,&fault1.latency,sizeof(fault1.latency));
+				get_field(&ptr,&fault1.result,sizeof(fault1.result));
+				printf("corresponding open record_id : %d \n",fault1.record_id_open);
+				printf("%s at offset : %lld, %s, latency : %llu ns, result : 0x%x \n",
+					fault1.kind=='k' ? "page_mkwrite" : fault1.kind=='w' ? "write fault" : "read fault",
+					fault1.offset,fault1.major ? "major" : "minor",fault1.latency,fault1.result);
+				/* faults are sampled, there is no access pattern to replay */
+				break;
+				
+			case 'A':
+				printf("record type : setattr \n");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&at1.valid,sizeof(at1.valid));
+				get_field(&ptr,&at1.mode,sizeof(at1.mode));
+				get_field(&ptr,&at1.uid,sizeof(at1.uid));
+				get_field(&ptr,&at1.gid,sizeof(at1.gid));
+				get_field(&ptr,&at1.size,sizeof(at1.size));
+				get_field(&ptr,&at1.atime_sec,sizeof(at1.atime_sec));
+				get_field(&ptr,&at1.atime_nsec,sizeof(at1.atime_nsec));
+				get_field(&ptr,&at1.mtime_sec,sizeof(at1.mtime_sec));
+				get_field(&ptr,&at1.mtime_nsec,sizeof(at1.mtime_nsec));
+				at1.path=get_path(&ptr);
+				get_field(&ptr,&at1.err,sizeof(at1.err));
+				printf("attributes changed : 0x%x \n",at1.valid);
+				printf("path is : %s \n",at1.path);
+				
+				if(mode!=mode_n)
+				{
+					/* same order as notify_change: size, mode, owner, times */
+					at1.retval=0;
+					if(at1.valid & TRFS_ATTR_SIZE)
+					{
+						printf("truncate to : %lld \n",at1.size);
+						if(truncate(at1.path,at1.size)<0)
+							at1.retval=-1;
+					}
+					if(!at1.retval && (at1.valid & TRFS_ATTR_MODE))
+					{
+						printf("mode is : %ho \n",at1.mode);
+						if(chmod(at1.path,at1.mode & 07777)<0)
+							at1.retval=-1;
+					}
+					if(!at1.retval && (at1.valid & (TRFS_ATTR_UID|TRFS_ATTR_GID)))
+					{
+						if(lchown(at1.path,
+							  (at1.valid & TRFS_ATTR_UID) ? (uid_t)at1.uid : (uid_t)-1,
+							  (at1.valid & TRFS_ATTR_GID) ? (gid_t)at1.gid : (gid_t)-1)<0)
+							at1.retval=-1;
+					}
+					if(!at1.retval && (at1.valid & (TRFS_ATTR_ATIME|TRFS_ATTR_MTIME)))
+					{
+						ts[0].tv_sec=at1.atime_sec;
+						ts[0].tv_nsec=at1.atime_nsec;
+						ts[1].tv_sec=at1.mtime_sec;
+						ts[1].tv_nsec=at1.mtime_nsec;
+						if(!(at1.valid & TRFS_ATTR_ATIME))
+							ts[0].tv_nsec=UTIME_OMIT;
+						else if(!(at1.valid & TRFS_ATTR_ATIME_SET))
+							ts[0].tv_nsec=UTIME_NOW;
+						if(!(at1.valid & TRFS_ATTR_MTIME))
+							ts[1].tv_nsec=UTIME_OMIT;
+						else if(!(at1.valid & TRFS_ATTR_MTIME_SET))
+							ts[1].tv_nsec=UTIME_NOW;
+						if(utimensat(AT_FDCWD,at1.path,ts,AT_SYMLINK_NOFOLLOW)<0)
+							at1.retval=-1;
+					}
+					replay_result(mode,at1.err,at1.retval);
+				}
+				break;
+				
+			case 'T':
+				printf("record type : getattr \n");
+				ptr=ptr+sizeof(char);
+				
+				at1.path=get_path(&ptr);
+				printf("path is : %s \n",at1.path);
+				get_field(&ptr,&at1.err,sizeof(at1.err));
+				
+				if(mode!=mode_n)
+				{
+					struct stat st;
+					at1.retval=lstat(at1.path,&st);
+					replay_result(mode,at1.err,at1.retval);
+				}
+				break;
+				
+			case 'X':
+			case 'x':
+			case 'i':
+			case 'z':
+				printf("record type : %s \n",record_type=='X' ? "setxattr" :
+				       record_type=='x' ? "getxattr" :
+				       record_type=='i' ? "listxattr" : "removexattr");
+				ptr=ptr+sizeof(char);
+				
+				get_field(&ptr,&at1.flags,sizeof(at1.flags));
+				get_field(&ptr,&at1.value_size,sizeof(at1.value_size));
+				get_field(&ptr,&at1.stored,sizeof(at1.stored));
+				at1.value=ptr;
+				ptr=ptr+at1.stored;
+				at1.name=get_path(&ptr);
+				at1.path=get_path(&ptr);
+				get_field(&ptr,&at1.err,sizeof(at1.err));
+				printf("xattr name is : %s \n",at1.name);
+				printf("value size is : %u \n",at1.value_size);
+				printf("path is : %s \n",at1.path);
+				
+				if(mode!=mode_n)
+				{
+					/* a value cut to fit the record is replayed zero padded */
+					xbuf=(char *)calloc(1,at1.value_size ? at1.value_size : 1);
+					if(!xbuf)
+					{
+						printf("out of memory \n");
+						exit(1);
+					}
+					switch(record_type)
+					{
+						case 'X':
+							memcpy(xbuf,at1.value,at1.stored);
+							at1.retval=lsetxattr(at1.path,at1.name,xbuf,at1.value_size,at1.flags);
+							break;
+						case 'x':
+							at1.retval=lgetxattr(at1.path,at1.name,xbuf,at1.value_size);
+							break;
+						case 'i':
+							at1.retval=llistxattr(at1.path,xbuf,at1.value_size);
+							break;
+						default:
+							at1.retval=lremovexattr(at1.path,at1.name);
+							break;
+					}
+					free(xbuf);
+					replay_result(mode,at1.err,at1.retval);
+				}
+				break;
+				
+		}
+		
+		
+		
+	 printf("\n");	
+	 
+	 //moving the stream to its next record, dropping it at the end
+	 if(!stream_next(cur))
+		heap[0]=heap[--heap_size];
+	 heap_sift_down(heap,heap_size,0);
+	}
+	if(summary)
+	{
+		printf("records per context : \n");
+		for(i=1;i<nr_ctxs;i++)
+		{
+			if(ctxs[i].records)
+				printf("%u : %s pid %d tgid %d uid %u cgroup %llu : %lu records \n",i,ctxs[i].comm,ctxs[i].pid,ctxs[i].tgid,ctxs[i].uid,ctxs[i].cgroup,ctxs[i].records);
+		}
+		cache_report(cache_files,nr_cache_files);
+	}
+	for(i=0;i<nr_cache_files;i++)
+		free(cache_files[i].path);
+	free(cache_files);
+	free(cache_opens);
+	for(i=0;i<nr_streams;i++)
+		close(streams[i].fd);
+	free(streams);
+	free(heap);
+	free(ctxs);
+	free(dedup_ring);
+	  return 0;
+}
@@ -1,63 +1,237 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-
-typedef struct lookup{
-	int key;
-	int fd;
-}lookup;
-
-typedef struct open_struct{
-	unsigned int flags;
-	unsigned short mode;
-	unsigned short pathname_length;
-	char *pathname;
-	int errno;
-	int retval;
-	
-}open_struct;
-
-typedef struct read_struct{
-	int record_id_open;
-	char * buf;
-	size_t user_bytes; // number of bytes to be read entered by user
-	int errno; //return value from read call
-	int fd;
-	int num_bytes;//number of bytes read in treplay 
-	char *trace_buf;
-	
-}read_struct;
-
-typedef struct write_struct{
-	int record_id_open;
-	size_t count;//number of bytes entered by user
-	char * buf;
-	int errno;//return value from trfs write
-	int fd;
-	int num_bytes; //number of bytes in trace 
-	
-}write_struct;
-
-typedef struct close_struct{
-	int record_id_open;
-	int fd;
-	int retval; // value returned at trace 
-}close_struct;
-
-typedef struct mkdir_struct{
-	unsigned short mode;
-	unsigned short path_size;
-	char * path;
-	int errno;
-	int retval;
-}mkdir_struct;
-
-typedef struct rmdir_struct{
-	unsigned short path_size;
-	char * path;
-	int errno;
-	int retval;
-}rmdir_struct;
-
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* one tfile stream; per-cpu mounts write several, merged on record id */
+typedef struct trace_stream{
+	int fd;
+	unsigned short record_size; // size of the record without the size field
+	int record_id;
+	char *buffer; // current record, starting at the record id
+}trace_stream;
+
+typedef struct lookup{
+	int key;
+	int fd;
+}lookup;
+
+typedef struct open_struct{
+	unsigned int flags;
+	unsigned short mode;
+	unsigned short pathname_length;
+	char *pathname;
+	int errno;
+	int retval;
+	
+}open_struct;
+
+typedef struct read_struct{
+	int record_id_open;
+	long long offset; // file offset the read started at
+	char * buf;
+	size_t user_bytes; // number of bytes to be read entered by user
+	int errno; //return value from read call
+	int fd;
+	int num_bytes;//number of bytes read in treplay 
+	char *trace_buf;
+	unsigned int stored; // bytes of the data kept in the record
+	unsigned int digest; // crc32 of all the data read
+	char no_data; // TRFS_PAYLOAD_NONE: neither data nor digest were captured
+	unsigned int pages; // pages of the range, 0 if not probed
+	unsigned int cached; // of them in the page cache before the read
+	
+}read_struct;
+
+typedef struct write_struct{
+	int record_id_open;
+	long long offset; // file offset the write landed at
+	size_t count;//number of bytes entered by user
+	char * buf;
+	int errno;//return value from trfs write
+	int fd;
+	int num_bytes; //number of bytes in trace 
+	unsigned int stored; // bytes of the data kept in the record
+	unsigned int digest; // crc32 of all the data written
+	char no_data; // TRFS_PAYLOAD_NONE: neither data nor digest were captured
+	char *data; // the data kept, resolved for deduped records
+	
+}write_struct;
+
+typedef struct close_struct{
+	int record_id_open;
+	int fd;
+	int retval; // value returned at trace 
+}close_struct;
+
+typedef struct mkdir_struct{
+	unsigned short mode;
+	unsigned short path_size;
+	char * path;
+	int errno;
+	int retval;
+}mkdir_struct;
+
+typedef struct rmdir_struct{
+	unsigned short path_size;
+	char * path;
+	int errno;
+	int retval;
+}rmdir_struct;
+
+/* create, unlink, rename, link, symlink and mknod records */
+typedef struct ns_struct{
+	unsigned short mode;
+	unsigned int dev; // new_encode_dev() of the kernel
+	char *path;
+	char *path2; // new name for rename and link, link target for symlink
+	int err; // return value from trfs
+	int retval;
+}ns_struct;
+
+/* setattr, getattr and xattr records */
+typedef struct attr_struct{
+	unsigned int valid; // TRFS_ATTR_* bits of the setattr
+	unsigned short mode;
+	unsigned int uid;
+	unsigned int gid;
+	long long size;
+	long long atime_sec;
+	unsigned int atime_nsec;
+	long long mtime_sec;
+	unsigned int mtime_nsec;
+	int flags; // setxattr flags
+	unsigned int value_size; // value size passed to the xattr call
+	unsigned int stored; // bytes of the value kept in the record
+	char *value;
+	char *name; // xattr name
+	char *path;
+	int err; // return value from trfs
+	int retval;
+}attr_struct;
+
+/* fsync, flush, llseek and fallocate records, all on an open file */
+typedef struct sync_struct{
+	int record_id_open;
+	int fd;
+	long long start; // fsync range start, llseek and fallocate offset
+	long long end; // fsync range end, llseek result, fallocate length
+	int flag; // datasync, llseek whence or fallocate mode
+	int err; // return value from trfs
+	int retval;
+}sync_struct;
+
+/* getdents64 entry header, the name follows */
+typedef struct linux_dirent64{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+}linux_dirent64;
+
+/* readdir records */
+typedef struct dir_struct{
+	int record_id_open;
+	int fd;
+	unsigned int entries; // entries returned by trfs
+	long long start; // directory position before and after
+	long long end;
+	char *buf;
+	size_t size;
+	int err; // return value from trfs
+	int retval;
+}dir_struct;
+
+#define TASK_COMM_LEN 16
+
+/* a task as defined by a 'D' record, later records carry only its id */
+typedef struct ctx_struct{
+	int pid;
+	int tgid;
+	unsigned int uid;
+	unsigned long long cgroup; // cgroup v2 id
+	char comm[TASK_COMM_LEN + 1];
+	unsigned long records; // calls traced for the task
+}ctx_struct;
+
+/* a run of contiguous reads or writes coalesced into one record */
+typedef struct range_struct{
+	int record_id_open;
+	int fd;
+	char type; // 'r' or 'w'
+	long long offset;
+	unsigned long long bytes;
+	unsigned int ops; // calls in the run
+	unsigned long long first_ns; // time of the first and last call
+	unsigned long long last_ns;
+	unsigned int pages; // summed page cache probes of the reads
+	unsigned int cached;
+	unsigned long long chunk; // bytes replayed per call
+	unsigned long long done;
+	char *buf;
+	int retval;
+}range_struct;
+
+/* a splice ('P') or iter I/O ('v') on a traced open, the range only */
+typedef struct splice_struct{
+	int record_id_open;
+	int fd;
+	char type; // 'r' or 'w'
+	long long offset;
+	unsigned long long len; // bytes asked for
+	long long result; // bytes spliced or error from trfs
+	unsigned int pages; // page cache probe of a read
+	unsigned int cached;
+	unsigned long long done;
+	char *buf;
+	int retval;
+}splice_struct;
+
+/* a copy_file_range ('y') or clone ('L') between two traced opens */
+typedef struct copy_struct{
+	int record_id_in;
+	int record_id_out;
+	int fd_in;
+	int fd_out;
+	long long pos_in;
+	long long pos_out;
+	unsigned long long len;
+	long long result; // bytes copied, or error from trfs
+	int retval;
+}copy_struct;
+
+/* a 'Z' checkpoint, written at sync, freeze and unfreeze */
+typedef struct checkpoint_struct{
+	char reason; // 's' sync, 'f' freeze, 'u' unfreeze
+	unsigned long long time_ns; // wall clock
+}checkpoint_struct;
+
+/* page cache hits of the reads of a file or directory, for -c */
+typedef struct cache_stat{
+	char *path;
+	unsigned long long pages;
+	unsigned long long cached;
+}cache_stat;
+
+/* the file an open record id is for, an index in the cache_stat table */
+typedef struct open_file{
+	int key;
+	int file;
+}open_file;
+
+/* a sampled mmap fault ('M'), reported only */
+typedef struct fault_struct{
+	int record_id_open;
+	long long offset; // file offset of the page
+	char kind; // 'r' read fault, 'w' write fault, 'k' page_mkwrite
+	char major; // the page had to be read in
+	unsigned long long latency; // ns
+	unsigned int result; // VM_FAULT_* flags
+}fault_struct;
+
+/* data of a recent deduped write record, for resolving chunk references */
+typedef struct dedup_slot{
+	int id; // record id
+	char data[4096];
+}dedup_slot;
@@ -11,6 +11,40 @@
 
 #include "trfs.h"
 
+/*
+ * A negative dentry of ours is valid while its lower dentry is still
+ * negative and hashed, i.e. nothing was created under that name in the
+ * lower directory behind our back.
+ */
+static inline bool trfs_negative_stale(struct dentry *lower_dentry)
+{
+	return READ_ONCE(lower_dentry->d_inode) || d_unhashed(lower_dentry);
+}
+
+/*
+ * RCU-walk revalidate: no references may be taken, and @dentry can be
+ * released under us, so only look at what stays valid until the walk
+ * drops rcu_read_lock: the dentry info (freed after a grace period) and
+ * the lower dentry (hashed dentries are RCU freed too).  A lower dentry
+ * with its own revalidate, or no lower dentry any more, goes to ref-walk.
+ */
+static int trfs_d_revalidate_rcu(struct dentry *dentry)
+{
+	struct trfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
+	struct dentry *lower_dentry;
+
+	if (!info)
+		return -ECHILD;
+	lower_dentry = READ_ONCE(info->lower_path.dentry);
+	if (!lower_dentry ||
+	    (READ_ONCE(lower_dentry->d_flags) & DCACHE_OP_REVALIDATE))
+		return -ECHILD;
+	/* a stale negative dentry is dropped in ref-walk */
+	if (!READ_ONCE(dentry->d_inode) && trfs_negative_stale(lower_dentry))
+		return -ECHILD;
+	return 1;
+}
+
 /*
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
@@ -23,15 +57,15 @@ static int trfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	int err = 1;
 
 	if (flags & LOOKUP_RCU)
-		return -ECHILD;
+		return trfs_d_revalidate_rcu(dentry);
 
-	trfs_get_lower_path(dentry, &lower_path);
+	trfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
-		goto out;
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
-out:
-	trfs_put_lower_path(dentry, &lower_path);
+	if (lower_dentry->d_flags & DCACHE_OP_REVALIDATE)
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+	if (err > 0 && d_really_is_negative(dentry) &&
+	    trfs_negative_stale(lower_dentry))
+		err = 0;
 	return err;
 }
 
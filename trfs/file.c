@@ -10,24 +10,370 @@
  */
 
 #include "trfs.h"
-#include "../../hw2/trctl.h"
+#include <linux/crc32.h>
 
+/* one trfs_file_info per open file, so keep them in their own cache */
+static struct kmem_cache *trfs_file_info_cachep;
 
+int trfs_init_file_cache(void)
+{
+	trfs_file_info_cachep =
+		kmem_cache_create("trfs_file_info",
+				  sizeof(struct trfs_file_info),
+				  0, SLAB_RECLAIM_ACCOUNT, NULL);
 
+	return trfs_file_info_cachep ? 0 : -ENOMEM;
+}
 
-//static DEFINE_MUTEX(buffer_lock);
+void trfs_destroy_file_cache(void)
+{
+	if (trfs_file_info_cachep)
+		kmem_cache_destroy(trfs_file_info_cachep);
+}
 
+struct trfs_file_info *trfs_alloc_file_info(void)
+{
+	struct trfs_file_info *info;
 
-static int write_file(struct file *file,char *buff, int len){
-	int ret;
-	mm_segment_t fs;
-	fs = get_fs();
-	set_fs(get_ds());
-	
-	ret = vfs_write(file,buff,len,&file->f_pos);
+	info = kmem_cache_zalloc(trfs_file_info_cachep, GFP_KERNEL);
+	if (info) {
+		spin_lock_init(&info->range_lock);
+		INIT_LIST_HEAD(&info->run_node);
+	}
+	return info;
+}
+
+void trfs_free_file_info(struct trfs_file_info *info)
+{
+	if (info)
+		kmem_cache_free(trfs_file_info_cachep, info);
+}
+
+/* record a coalesced run as one 'Q' range record */
+static void trfs_record_range(struct trfs_sb_info *sbi, int open_record_id,
+			      struct trfs_io_range *r)
+{
+	struct trfs_record rec;
+	u64 bytes = r->end - r->start;
+
+	if (trfs_record_begin(sbi, &rec, 'Q', TRFS_REC_HDR_SIZE +
+			      sizeof(open_record_id) + sizeof(r->type) +
+			      sizeof(r->start) + sizeof(bytes) +
+			      sizeof(r->ops) + sizeof(r->first_ns) +
+			      sizeof(r->last_ns) + sizeof(r->pages) +
+			      sizeof(r->cached)))
+		return;
+	trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+	trfs_record_put(&rec, &r->type, sizeof(r->type));
+	trfs_record_put(&rec, &r->start, sizeof(r->start));
+	trfs_record_put(&rec, &bytes, sizeof(bytes));
+	trfs_record_put(&rec, &r->ops, sizeof(r->ops));
+	trfs_record_put(&rec, &r->first_ns, sizeof(r->first_ns));
+	trfs_record_put(&rec, &r->last_ns, sizeof(r->last_ns));
+	trfs_record_put(&rec, &r->pages, sizeof(r->pages));
+	trfs_record_put(&rec, &r->cached, sizeof(r->cached));
+	trfs_record_end(&rec);
+}
+
+/* wait for a walk of the runs, and the records it is writing, to finish */
+static void trfs_wait_runs(struct trfs_sb_info *sbi)
+{
+	mutex_lock(&sbi->runs_mutex);
+	mutex_unlock(&sbi->runs_mutex);
+}
 
-	set_fs(fs);
-	return ret;
+/*
+ * With coalescing on (the coalesce_ms knob), successful reads and writes
+ * are folded into a run of contiguous same-direction ops on the file,
+ * recorded once the run ends: on a gap, a change of direction, an op
+ * failing, more than coalesce_ms between two ops, or any other traced op
+ * on the file (trfs_end_range).  Runs left idle are ended from
+ * sbi->run_work (trfs_expire_runs), so they don't wait for the next op
+ * on the file, which may never come.
+ *
+ * Returns true if the op went into a run, false if the caller has to
+ * record it itself.  The page cache probe of a read, @pages and @cached,
+ * adds up over the run.
+ */
+static bool trfs_coalesce(struct file *file, char type, s64 pos,
+			  ssize_t bytes, u32 pages, u32 cached)
+{
+	struct trfs_sb_info *sbi = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_file_info *fi = TRFS_F(file);
+	struct trfs_io_range *r = &fi->range, done;
+	unsigned int ms = READ_ONCE(sbi->coalesce_ms);
+	bool merge = ms && bytes > 0, started = false, wait;
+	u64 now = ktime_get_ns();
+
+	done.type = 0;
+	spin_lock(&fi->range_lock);
+	if (r->type && (!merge || r->type != type || r->end != pos ||
+			now - r->last_ns > (u64)ms * NSEC_PER_MSEC)) {
+		done = *r;
+		r->type = 0;
+	}
+	if (merge) {
+		if (!r->type) {
+			r->type = type;
+			r->start = pos;
+			r->end = pos;
+			r->ops = 0;
+			r->first_ns = now;
+			r->pages = 0;
+			r->cached = 0;
+			started = true;
+		}
+		r->end += bytes;
+		r->ops++;
+		r->pages += pages;
+		r->cached += cached;
+		r->last_ns = now;
+	}
+	/* what we record now goes after the run being expired, if any */
+	wait = fi->expiring && (done.type || !merge);
+	spin_unlock(&fi->range_lock);
+
+	if (wait)
+		trfs_wait_runs(sbi);
+	if (done.type)
+		trfs_record_range(sbi, fi->record_id, &done);
+	if (started) {
+		/* a file leaves sbi->runs only when closed, see below */
+		if (list_empty(&fi->run_node)) {
+			spin_lock(&sbi->runs_lock);
+			if (list_empty(&fi->run_node))
+				list_add_tail(&fi->run_node, &sbi->runs);
+			spin_unlock(&sbi->runs_lock);
+		}
+		schedule_delayed_work(&sbi->run_work, msecs_to_jiffies(ms));
+	}
+	return merge;
+}
+
+/*
+ * Record the open runs of the mount's files that have been idle for more
+ * than coalesce_ms, or all of them with @all.  Files stay on sbi->runs
+ * from their first run until closed (trfs_forget_runs); a walk moves
+ * them to a list of its own and back as it goes, so it can drop the
+ * lock to write a record without losing its place, and a file closed
+ * meanwhile just goes off whichever list it is on.  While the run of a
+ * file is being recorded the file is marked expiring: its next records
+ * wait for the walk (trfs_wait_runs), so they still follow the run, and
+ * it isn't freed under us.
+ *
+ * Returns true if some run is still open.
+ */
+bool trfs_end_runs(struct trfs_sb_info *sbi, bool all)
+{
+	struct trfs_file_info *fi;
+	struct trfs_io_range *r, done;
+	u64 idle = (u64)READ_ONCE(sbi->coalesce_ms) * NSEC_PER_MSEC;
+	int open_record_id;
+	bool open = false;
+	LIST_HEAD(walk);
+
+	mutex_lock(&sbi->runs_mutex);
+	spin_lock(&sbi->runs_lock);
+	list_splice_init(&sbi->runs, &walk);
+	while (!list_empty(&walk)) {
+		fi = list_first_entry(&walk, struct trfs_file_info, run_node);
+		list_move_tail(&fi->run_node, &sbi->runs);
+		r = &fi->range;
+		done.type = 0;
+		spin_lock(&fi->range_lock);
+		if (r->type && (all || !idle ||
+				ktime_get_ns() - r->last_ns > idle)) {
+			done = *r;
+			r->type = 0;
+			fi->expiring = true;
+		}
+		open |= r->type != 0;
+		open_record_id = fi->record_id;
+		spin_unlock(&fi->range_lock);
+		if (!done.type)
+			continue;
+		spin_unlock(&sbi->runs_lock);
+		trfs_record_range(sbi, open_record_id, &done);
+		spin_lock(&sbi->runs_lock);
+		spin_lock(&fi->range_lock);
+		fi->expiring = false;
+		spin_unlock(&fi->range_lock);
+	}
+	spin_unlock(&sbi->runs_lock);
+	mutex_unlock(&sbi->runs_mutex);
+	return open;
+}
+
+/*
+ * sbi->run_work, queued when a run starts: end the runs gone idle and
+ * look again while any is open.  Their records go under the worker's
+ * context, the task that did the I/O may be long gone.
+ */
+void trfs_expire_runs(struct work_struct *work)
+{
+	struct trfs_sb_info *sbi = container_of(to_delayed_work(work),
+						struct trfs_sb_info, run_work);
+
+	if (trfs_end_runs(sbi, false))
+		schedule_delayed_work(&sbi->run_work,
+			msecs_to_jiffies(READ_ONCE(sbi->coalesce_ms)));
+}
+
+/* take a file being closed, its run ended, off sbi->runs */
+static void trfs_forget_runs(struct trfs_sb_info *sbi,
+			     struct trfs_file_info *fi)
+{
+	if (list_empty(&fi->run_node))
+		return;
+	spin_lock(&sbi->runs_lock);
+	list_del_init(&fi->run_node);
+	spin_unlock(&sbi->runs_lock);
+}
+
+/* record the file's open run, if any, ahead of another op on the file */
+static void trfs_end_range(struct file *file)
+{
+	struct trfs_file_info *fi = TRFS_F(file);
+	struct trfs_io_range done;
+	bool wait;
+
+	spin_lock(&fi->range_lock);
+	done = fi->range;
+	fi->range.type = 0;
+	wait = fi->expiring;
+	spin_unlock(&fi->range_lock);
+
+	if (wait)
+		trfs_wait_runs(TRFS_SB(file->f_inode->i_sb));
+	if (done.type)
+		trfs_record_range(TRFS_SB(file->f_inode->i_sb),
+				  fi->record_id, &done);
+}
+
+/* the F_SETFL flags that change how the lower file does I/O */
+#define TRFS_SETFL_MASK	(O_APPEND | O_NONBLOCK | O_NDELAY | O_DIRECT)
+
+/*
+ * fcntl(F_SETFL) only changes our file's flags, so carry them over to the
+ * lower file before it does I/O; otherwise turning on O_DIRECT after open
+ * would leave the lower file buffered.  The lower file gets the checks
+ * setfl() did against ours.  The same goes for FMODE_RANDOM, which
+ * fadvise(POSIX_FADV_RANDOM/NORMAL/SEQUENTIAL) sets and clears on ours,
+ * and which turns off readahead on the lower file.
+ */
+static int trfs_sync_flags(struct file *file, struct file *lower_file)
+{
+	unsigned int flags = file->f_flags & TRFS_SETFL_MASK;
+	const struct address_space_operations *a_ops;
+
+	if (unlikely((file->f_mode ^ lower_file->f_mode) & FMODE_RANDOM)) {
+		spin_lock(&lower_file->f_lock);
+		lower_file->f_mode = (lower_file->f_mode & ~FMODE_RANDOM) |
+				     (file->f_mode & FMODE_RANDOM);
+		spin_unlock(&lower_file->f_lock);
+	}
+
+	if (likely(flags == (lower_file->f_flags & TRFS_SETFL_MASK)))
+		return 0;
+
+	if (((flags ^ lower_file->f_flags) & O_APPEND) &&
+	    IS_APPEND(file_inode(lower_file)))
+		return -EPERM;
+	a_ops = lower_file->f_mapping->a_ops;
+	if ((flags & O_DIRECT) && (!a_ops || !a_ops->direct_IO))
+		return -EINVAL;
+	if (lower_file->f_op->check_flags &&
+	    lower_file->f_op->check_flags(flags))
+		return -EINVAL;
+
+	spin_lock(&lower_file->f_lock);
+	lower_file->f_flags = (lower_file->f_flags & ~TRFS_SETFL_MASK) | flags;
+	spin_unlock(&lower_file->f_lock);
+	return 0;
+}
+
+/*
+ * Page cache residency of a traced read, probed in the lower mapping
+ * before the lower read: of the *@pages pages the range covers up to
+ * eof, *@cached were in the page cache, which tells a read served from
+ * memory from one that waited on the disk.  A page still being read in
+ * counts as cached.  Direct I/O (a zero @count) and untraced reads are
+ * not probed and get 0 pages.
+ */
+static void trfs_probe_cache(struct file *file, struct file *lower_file,
+			     s64 pos, size_t count, u32 *pages, u32 *cached)
+{
+	struct address_space *mapping = lower_file->f_mapping;
+	loff_t isize = i_size_read(file_inode(lower_file));
+	pgoff_t index, last, hole;
+
+	*pages = 0;
+	*cached = 0;
+	if (!count || pos < 0 || pos >= isize ||
+	    (lower_file->f_flags & O_DIRECT) ||
+	    !trfs_traced(TRFS_SB(file->f_inode->i_sb), file_inode(file),
+			 TRFS_TRACE_READ))
+		return;
+
+	index = pos >> PAGE_SHIFT;
+	last = (min_t(loff_t, pos + count, isize) - 1) >> PAGE_SHIFT;
+	*pages = last - index + 1;
+	rcu_read_lock();
+	while (index <= last) {
+		hole = page_cache_next_hole(mapping, index, last - index + 1);
+		*cached += hole - index;
+		index = hole + 1;
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Payload of a read or write record: the first bytes of the @len byte
+ * user buffer, as many as the payload_cap knob and the @room left in the
+ * record allow, copied to @buff.  *@digest gets the crc32 of the whole
+ * buffer, so replay can check the bytes it makes up for the rest.  The
+ * kept bytes are those of the first window the digest went through, so
+ * both are taken from the same copy of the data.
+ *
+ * Returns the number of bytes kept in @buff, *@stored gets the record's
+ * field for it: the same number, or TRFS_PAYLOAD_NONE (nothing kept) if
+ * the buffer faulted.
+ */
+static size_t trfs_payload(struct trfs_sb_info *sbi, char *buff,
+			   const char __user *ubuf, size_t len, size_t room,
+			   u32 *stored, u32 *digest)
+{
+	int cap = READ_ONCE(sbi->payload_cap);
+	size_t kept = len, off, n;
+	char *window = buff;
+	u32 crc = ~0;
+
+	if (cap >= 0 && kept > (size_t)cap)
+		kept = cap;
+	if (kept > room)
+		kept = room;
+
+	/* windows after the first go through their own buffer */
+	if (len > TRFS_MAX_RECORD)
+		window = trfs_window_alloc();
+	for (off = 0; off < len; off += n) {
+		n = min_t(size_t, len - off, TRFS_MAX_RECORD);
+		if (copy_from_user(off ? window : buff, ubuf + off, n))
+			goto out_none;
+		crc = crc32_le(crc, off ? window : buff, n);
+	}
+	if (window != buff)
+		trfs_window_free(window);
+	*stored = kept;
+	*digest = ~crc;
+	return kept;
+
+out_none:
+	if (window != buff)
+		trfs_window_free(window);
+	*stored = TRFS_PAYLOAD_NONE;
+	*digest = 0;
+	return 0;
 }
 
 static ssize_t trfs_read(struct file *file, char __user *buf,
@@ -38,97 +384,62 @@ static ssize_t trfs_read(struct file *file, char __user *buf,
 	struct dentry *dentry = file->f_path.dentry;
 	int ioctl_flag;
 
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)file->f_inode->i_sb->s_fs_info;
-	
-	
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
 
 	char type = 'r';
-	char *buffcpy = sb_info->buffer;
-	u16 size = sizeof(size);
+	size_t size;
 	struct trfs_file_info *fp_info= (struct trfs_file_info *)file->private_data;
 	int open_record_id = fp_info->record_id;
 	char *buff = NULL;
+	s64 pos;	/* offset the read started at */
+	u32 stored, digest;
+	size_t kept;
+	u32 pages, cached;
 	
-	if(sb_info->bitmap & 0x02) //setting the ioctl_flag based upon the bitmap value saved in sb's private data
+	if(trfs_traced(sb_info, file_inode(file), TRFS_TRACE_READ)) //setting the ioctl_flag based upon the bitmap value saved in sb's private data
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 	
 	lower_file = trfs_lower_file(file);
-	err = vfs_read(lower_file, buf, count, ppos);
-	/* update our inode atime upon a successful lower read */
+	pos = *ppos;
+	err = trfs_sync_flags(file, lower_file);
+	trfs_probe_cache(file, lower_file, pos, err ? 0 : count,
+			 &pages, &cached);
+	if (!err)
+		err = vfs_read(lower_file, buf, count, ppos);
+	/* update our inode atime upon a successful lower read, if it changed */
 	if (err >= 0)
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
+		trfs_update_atime(d_inode(dentry),
+				  file_inode(lower_file));
+
+	if (!ioctl_flag || trfs_coalesce(file, type, pos, err, pages, cached))
+		return err;
 
 	//calculating the size of the record
-	if (err>0) 
-	{
-		size = size + sizeof(sb_info->record_id) + sizeof(type) + sizeof(open_record_id) + sizeof(count) + err + sizeof(err);
+	size = TRFS_REC_HDR_SIZE + sizeof(open_record_id) + sizeof(pos) + sizeof(count) + sizeof(err) +
+		sizeof(pages) + sizeof(cached) + sizeof(stored) + sizeof(digest);
+	buff = trfs_staging_alloc();
+	kept = trfs_payload(sb_info, buff, buf, err > 0 ? err : 0,
+			    TRFS_MAX_RECORD - 1 - size, &stored, &digest);
+	size += kept;
+
+	/* writing the contents of the record to the sink and to the tfile eventually */
+	if (!trfs_record_begin(sb_info, &rec, type, size)) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &pos, sizeof(pos));
+		trfs_record_put(&rec, &count, sizeof(count));
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_put(&rec, &pages, sizeof(pages));
+		trfs_record_put(&rec, &cached, sizeof(cached));
+		trfs_record_put(&rec, &stored, sizeof(stored));
+		trfs_record_put(&rec, &digest, sizeof(digest));
+		trfs_record_put(&rec, buff, kept);
+		trfs_record_end(&rec);
 	}
-	else{
-		size = size + sizeof(sb_info->record_id) + sizeof(type) + sizeof(open_record_id) + sizeof(count) + sizeof(err);
-	}
-
-
-	mutex_lock(&sb_info->buffer_lock);   // locking the critical section so that it can't be modified parallelly
-	//
-	if(ioctl_flag){
-		if (size<4096 && size>0)
-		{
-			/* writing the contents of the record to the buffer and writing to the tfile eventually */
-
-			memcpy(sb_info->buffer,&size,sizeof(size));
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-			sb_info->record_id = sb_info->record_id + 1;
-		
-			memcpy(sb_info->buffer,&type,sizeof(type));
-
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			memcpy(sb_info->buffer,&open_record_id,sizeof(open_record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(open_record_id);
-
-			memcpy(sb_info->buffer,&count,sizeof(count));
-
-			sb_info->buffer = sb_info->buffer + sizeof(count);
-
-
-			memcpy(sb_info->buffer,&err,sizeof(err));
-
-			sb_info->buffer = sb_info->buffer + sizeof(err);
-
-			if(err>0){
-				buff = kzalloc(err,GFP_KERNEL);
-
-					if(copy_from_user(buff,buf,err)){
-						printk("copy_from_user Failed!");	
-					}
-
-				memcpy(sb_info->buffer,buff,err);
-
-				sb_info->buffer = sb_info->buffer + err;
-
-			}
-		
-			write_file(sb_info->tf,buffcpy,size);
-
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-		
-		}
-	}	
-	mutex_unlock(&sb_info->buffer_lock);
 
-	if (buff)
-	{
-		kfree(buff);
-	}
+	trfs_staging_free(buff);
 	return err;
 }
 
@@ -141,84 +452,99 @@ static ssize_t trfs_write(struct file *file, const char __user *buf,
 	struct dentry *dentry = file->f_path.dentry;
 	int ioctl_flag;
 	
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)file->f_inode->i_sb->s_fs_info;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
 
-	
 	char type = 'w';
-	char *buffcpy = sb_info->buffer;
-	u16 size = sizeof(size);
+	size_t size;
 	struct trfs_file_info *fp_info= (struct trfs_file_info *)file->private_data;
 	int open_record_id = fp_info->record_id;
 	char *buff = NULL;
-	//unsigned short s;
+	s64 pos;	/* offset the write landed at */
+	u32 stored, digest;
+	size_t room, kept;
 
 
-	if(sb_info->bitmap & 0x04)
+	if(trfs_traced(sb_info, file_inode(file), TRFS_TRACE_WRITE))
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 
-	buff = kzalloc(count,GFP_KERNEL);
-
 	lower_file = trfs_lower_file(file);
-	err = vfs_write(lower_file, buf, count, ppos);
+	pos = *ppos;
+	err = trfs_sync_flags(file, lower_file);
+	if (!err)
+		err = vfs_write(lower_file, buf, count, ppos);
+	/* O_APPEND writes land at eof, not at the offset passed in */
+	if (err > 0)
+		pos = *ppos - err;
 	/* update our inode times+sizes upon a successful lower write */
 	if (err >= 0) {
-		fsstack_copy_inode_size(d_inode(dentry),
-					file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(dentry),
-					file_inode(lower_file));
+		trfs_update_size_times(d_inode(dentry),
+				       file_inode(lower_file));
 	}
 
+	if (!ioctl_flag || trfs_coalesce(file, type, pos, err, 0, 0))
+		return err;
 
-	size = size + sizeof(sb_info->record_id) + sizeof(type) + sizeof(open_record_id) + sizeof(count) + count + sizeof(err);
-	
-	mutex_lock(&sb_info->buffer_lock);
-	if(ioctl_flag){
-		if (size<4096 && size>0)
-		{
-			memcpy(sb_info->buffer,&size,sizeof(size));
-		
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-			sb_info->record_id = sb_info->record_id + 1;
-		
-			memcpy(sb_info->buffer,&type,sizeof(type));
-
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			memcpy(sb_info->buffer,&open_record_id,sizeof(open_record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(open_record_id);
-
-			memcpy(sb_info->buffer,&count,sizeof(count));
-
-			sb_info->buffer = sb_info->buffer + sizeof(count);
-			//converting user's virtual address to physical address
-			if(copy_from_user(buff,buf,count)){
-				printk("copy_from_user Failed!");	
-			}
+	size = TRFS_REC_HDR_SIZE + sizeof(open_record_id) + sizeof(pos) + sizeof(count) + sizeof(stored) +
+		sizeof(digest) + sizeof(err);
 
-			memcpy(sb_info->buffer,buff,count);
+	/* deduped data is chunked, with a byte per chunk saying what it is */
+	room = TRFS_MAX_RECORD - 1 - size;
+	if (READ_ONCE(sb_info->dedup)) {
+		type = 'W';
+		room -= DIV_ROUND_UP(room, TRFS_DEDUP_CHUNK);
+	}
 
-			sb_info->buffer = sb_info->buffer + count;
+	/* the user buffer still holds what was written */
+	buff = trfs_staging_alloc();
+	kept = trfs_payload(sb_info, buff, buf, err < 0 ? 0 : count,
+			    room, &stored, &digest);
+	size += kept;
+	if (type == 'W')
+		size += DIV_ROUND_UP(kept, TRFS_DEDUP_CHUNK);
+
+	if (!trfs_record_begin(sb_info, &rec, type, size)) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &pos, sizeof(pos));
+		trfs_record_put(&rec, &count, sizeof(count));
+		trfs_record_put(&rec, &stored, sizeof(stored));
+		trfs_record_put(&rec, &digest, sizeof(digest));
+		if (type == 'W')
+			trfs_record_put_chunks(&rec, buff, kept);
+		else
+			trfs_record_put(&rec, buff, kept);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
 
-			memcpy(sb_info->buffer,&err,sizeof(err));
+	trfs_staging_free(buff);
+	return err;
+}
 
-			sb_info->buffer = sb_info->buffer + sizeof(err);
+/*
+ * When readdir is traced the lower fs fills a dir_context of ours, which
+ * passes the entries on to the caller's and counts them on the way.
+ */
+struct trfs_getdents_callback {
+	struct dir_context ctx;
+	struct dir_context *caller;
+	u32 entries;
+};
 
-			write_file(sb_info->tf,buffcpy,size);
+static int trfs_filldir(struct dir_context *ctx, const char *name,
+			int namelen, loff_t offset, u64 ino,
+			unsigned int d_type)
+{
+	struct trfs_getdents_callback *buf =
+		container_of(ctx, struct trfs_getdents_callback, ctx);
+	int err;
 
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-			
-		}
-	}	
-	mutex_unlock(&sb_info->buffer_lock);
-	kfree(buff);
+	err = buf->caller->actor(buf->caller, name, namelen, offset, ino,
+				 d_type);
+	if (!err)
+		buf->entries++;
 	return err;
 }
 
@@ -227,13 +553,48 @@ static int trfs_readdir(struct file *file, struct dir_context *ctx)
 	int err;
 	struct file *lower_file = NULL;
 	struct dentry *dentry = file->f_path.dentry;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+	struct trfs_getdents_callback buf = {
+		.ctx.actor = trfs_filldir,
+		.caller = ctx,
+	};
+	s64 pos[2];
 
 	lower_file = trfs_lower_file(file);
-	err = iterate_dir(lower_file, ctx);
-	file->f_pos = lower_file->f_pos;
+	if (!trfs_traced(sb_info, file_inode(file), TRFS_TRACE_READDIR) ||
+	    open_record_id == -1) {
+		err = iterate_dir(lower_file, ctx);
+		goto out;
+	}
+
+	pos[0] = ctx->pos;
+	buf.ctx.pos = ctx->pos;
+	err = iterate_dir(lower_file, &buf.ctx);
+	ctx->pos = buf.ctx.pos;
+	pos[1] = ctx->pos;
+
+	/* entries returned and the position the next getdents starts at */
+	if (!trfs_record_begin(sb_info, &rec, 'g', TRFS_REC_HDR_SIZE +
+			       sizeof(open_record_id) + sizeof(buf.entries) +
+			       sizeof(pos) + sizeof(err))) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &buf.entries, sizeof(buf.entries));
+		trfs_record_put(&rec, pos, sizeof(pos));
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+out:
+	/*
+	 * iterate_dir() on the lower file left its position in ctx->pos;
+	 * take it from there rather than rereading lower_file->f_pos, which
+	 * is no longer under the lower directory's lock.
+	 */
+	file->f_pos = ctx->pos;
 	if (err >= 0)		/* copy the atime */
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
+		trfs_update_atime(d_inode(dentry),
+				  file_inode(lower_file));
 	return err;
 }
 
@@ -245,6 +606,9 @@ static long trfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)file->f_inode->i_sb->s_fs_info;
 	int bitmap=sb_info->bitmap;
 	int set_bitmap=0;  // value passed by user
+	struct trfs_knob knob;
+	int *knob_ptr;
+	int knob_min;
 	
 	//printk("test test \n");
 	
@@ -335,7 +699,54 @@ static long trfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 			printk("hex-bitmap now set to %d \n",bitmap);
 			sb_info->bitmap=set_bitmap;
 			break;
-			
+
+		case TRFS_GET_KNOB:
+		case TRFS_SET_KNOB:
+			if (copy_from_user(&knob, (void __user *)arg, sizeof(knob))) {
+				err = -EFAULT;
+				goto out;
+			}
+			switch (knob.knob) {
+			case TRFS_KNOB_GETATTR_SAMPLE:
+				knob_ptr = &sb_info->getattr_sample;
+				knob_min = 1;
+				break;
+			case TRFS_KNOB_FAULT_SAMPLE:
+				knob_ptr = &sb_info->fault_sample;
+				knob_min = 1;
+				break;
+			case TRFS_KNOB_COALESCE_MS:
+				knob_ptr = &sb_info->coalesce_ms;
+				knob_min = 0;
+				break;
+			case TRFS_KNOB_PAYLOAD_CAP:
+				knob_ptr = &sb_info->payload_cap;
+				knob_min = -1;
+				break;
+			case TRFS_KNOB_DEDUP:
+				knob_ptr = &sb_info->dedup;
+				knob_min = 0;
+				break;
+			default:
+				err = -EINVAL;
+				goto out;
+			}
+			if (cmd == TRFS_SET_KNOB) {
+				if (knob.value < knob_min) {
+					err = -EINVAL;
+					goto out;
+				}
+				WRITE_ONCE(*knob_ptr, knob.value);
+				err = 0;
+				break;
+			}
+			knob.value = READ_ONCE(*knob_ptr);
+			if (copy_to_user((void __user *)arg, &knob, sizeof(knob))) {
+				err = -EFAULT;
+				goto out;
+			}
+			err = 0;
+			break;
 	}
 	
 out:
@@ -425,39 +836,24 @@ static int trfs_open(struct inode *inode, struct file *file)
 	struct file *lower_file = NULL;
 	struct path lower_path;
 	int ioctl_flag;
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)inode->i_sb->s_fs_info;
-	
+	struct trfs_sb_info *sb_info = TRFS_SB(inode->i_sb);
+	struct trfs_record rec;
+	int record_id = -1;
 	
-	//buffer locking syntax
-	
-		
-	
-	char *tmp = (char*)__get_free_page(GFP_TEMPORARY);
+	char *tmp = NULL;
 	char *path = NULL;
 	char type = 'o';
-	char *buffcpy = sb_info->buffer;
-	u16 size=sizeof(size);
-	u16 path_size;
 	
-	if(sb_info->bitmap & 0x01)
+	if(trfs_traced(sb_info, file_inode(file), TRFS_TRACE_OPEN))
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 
-	//path = d_path(&file->f_path,tmp,PAGE_SIZE);
-	// using dentry_path_raw function to get the relative path of the file which will be used in treplay
-	path = dentry_path_raw(file->f_path.dentry,tmp,PAGE_SIZE);
-	
-	//calculating size of the record and removing the / from the path for treplay purposes
-	if(path){  
-		if(strlen(path)>1){
-			printk("path: %s\n",path);
-			path = path + 1;
-			size = size + sizeof(sb_info->record_id)+sizeof(type)+sizeof(file->f_flags)+sizeof(inode->i_mode)+sizeof(path_size)+strlen(path)+1+sizeof(err);
-		}
+	// relative path of the file (without the leading /) which will be used in treplay
+	if (ioctl_flag) {
+		tmp = trfs_staging_alloc();
+		path = trfs_record_path(file->f_path.dentry, tmp, TRFS_MAX_RECORD);
 	}
-	
-
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -465,17 +861,16 @@ static int trfs_open(struct inode *inode, struct file *file)
 		goto out_err;
 	}
 
-	file->private_data =
-		kzalloc(sizeof(struct trfs_file_info), GFP_KERNEL);
+	file->private_data = trfs_alloc_file_info();
 	if (!TRFS_F(file)) {
 		err = -ENOMEM;
 		goto out_err;
 	}
 
 	/* open lower object and link trfs's file struct to lower's */
-	trfs_get_lower_path(file->f_path.dentry, &lower_path);
+	/* dentry_open takes its own references on the lower path */
+	trfs_peek_lower_path(file->f_path.dentry, &lower_path);
 	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-	path_put(&lower_path);
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
 		lower_file = trfs_lower_file(file);
@@ -486,76 +881,31 @@ static int trfs_open(struct inode *inode, struct file *file)
 	} else {
 		trfs_set_lower_file(file, lower_file);
 	}
-	
-	//setting the record id of the open function in the file's private data, so that it can be used as key for looking up fd in read and write treplays
-
-	if(ioctl_flag){   
-		if (size<4096 && size>sizeof(size) )
-		{
-			trfs_set_record(file,sb_info->record_id);
-		}
-		else{
-			trfs_set_record(file,-1);
-		}
-	}else{
-			trfs_set_record(file,-1);
-	}
 
 	if (err)
-		kfree(TRFS_F(file));
+		trfs_free_file_info(TRFS_F(file));
 	else
 		fsstack_copy_attr_all(inode, trfs_lower_inode(inode));
 out_err:
 
-	mutex_lock(&sb_info->buffer_lock); //locking the critical section
-	if(ioctl_flag){
-		if (size<4096 && size>sizeof(size) )
-		{
-		
-			memcpy(sb_info->buffer,&size,sizeof(size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-		
-			sb_info->record_id = sb_info->record_id + 1;
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-		
-			memcpy(sb_info->buffer,&type,sizeof(type));
-		
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			memcpy(sb_info->buffer,&(file->f_flags),sizeof(file->f_flags));
-		
-			sb_info->buffer = sb_info->buffer + sizeof(file->f_flags);
-		
-			memcpy(sb_info->buffer,&(inode->i_mode),sizeof(inode->i_mode));
-		
-			sb_info->buffer = sb_info->buffer + sizeof(inode->i_mode);
-		
-			path_size = strlen(path) + 1;
-		
-			memcpy(sb_info->buffer, &path_size, sizeof(path_size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(path_size);
-		
-			memcpy(sb_info->buffer,path, strlen(path) + 1);
-		
-			sb_info->buffer = sb_info->buffer + strlen(path) + 1;
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + sizeof(file->f_flags) +
+			sizeof(inode->i_mode) + trfs_path_size(path) +
+			sizeof(err))) {
+		record_id = rec.id;
+
+		trfs_record_put(&rec, &(file->f_flags), sizeof(file->f_flags));
+		trfs_record_put(&rec, &(inode->i_mode), sizeof(inode->i_mode));
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
 
-			memcpy(sb_info->buffer,&err,sizeof(err));
-			sb_info->buffer = sb_info->buffer + sizeof(err);
-		
-		
-			write_file(sb_info->tf,buffcpy,size);
+	//setting the record id of the open function in the file's private data, so that it can be used as key for looking up fd in read and write treplays
+	if (!err)
+		trfs_set_record(file, record_id);
 
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-		
-		}
-	}	
-	mutex_unlock(&sb_info->buffer_lock);
-	free_page((unsigned long)tmp);
+	trfs_staging_free(tmp);
 	return err;
 }
 
@@ -564,12 +914,24 @@ static int trfs_flush(struct file *file, fl_owner_t id)
 	int err = 0;
 	struct file *lower_file = NULL;
 
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+
 	lower_file = trfs_lower_file(file);
 	if (lower_file && lower_file->f_op && lower_file->f_op->flush) {
 		filemap_write_and_wait(file->f_mapping);
 		err = lower_file->f_op->flush(lower_file, id);
 	}
 
+	trfs_end_range(file);
+	if (trfs_traced(sb_info, file_inode(file), TRFS_TRACE_FLUSH) && open_record_id != -1 &&
+	    !trfs_record_begin(sb_info, &rec, 'F', TRFS_REC_HDR_SIZE +
+			       sizeof(open_record_id) + sizeof(err))) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
 	return err;
 }
 
@@ -578,59 +940,40 @@ static int trfs_file_release(struct inode *inode, struct file *file)
 {
 	struct file *lower_file;
 	int ioctl_flag;
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)file->f_inode->i_sb->s_fs_info;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
 
-	
 	char type = 'c';
-	char *buffcpy = sb_info->buffer;
-	u16 size = sizeof(size);
+	size_t size;
 	struct trfs_file_info *fp_info= (struct trfs_file_info *)file->private_data;
 	int open_record_id = fp_info->record_id;
 
 
-	if(sb_info->bitmap & 0x10)
+	if(trfs_traced(sb_info, file_inode(file), TRFS_TRACE_CLOSE))
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 
-	size = size + sizeof(size) + sizeof(sb_info->record_id) + sizeof(open_record_id) + sizeof(type);
+	size = TRFS_REC_HDR_SIZE + sizeof(open_record_id);
 
 	lower_file = trfs_lower_file(file);
 	if (lower_file) {
+		/* the I/O paths only copied what changed, catch up in full */
+		fsstack_copy_inode_size(inode, file_inode(lower_file));
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
 		trfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}
 
-	mutex_lock(&sb_info->buffer_lock);
-	if(ioctl_flag){
-		if(size<4096 && size>0 && open_record_id!= -1){
-			memcpy(sb_info->buffer,&size,sizeof(size));
-		
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-			sb_info->record_id = sb_info->record_id + 1;
-		
-			memcpy(sb_info->buffer,&type,sizeof(type));
-
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			memcpy(sb_info->buffer,&open_record_id,sizeof(open_record_id));
-
-			sb_info->buffer = sb_info->buffer + sizeof(open_record_id);
-
-			write_file(sb_info->tf,buffcpy,size);
-
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-
-		}	
+	trfs_end_range(file);
+	trfs_forget_runs(sb_info, fp_info);
+	if (ioctl_flag && open_record_id != -1 &&
+	    !trfs_record_begin(sb_info, &rec, type, size)) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_end(&rec);
 	}
-	mutex_unlock(&sb_info->buffer_lock);
 		
-	kfree(TRFS_F(file));
+	trfs_free_file_info(TRFS_F(file));
 	return 0;
 }
 
@@ -639,17 +982,30 @@ static int trfs_fsync(struct file *file, loff_t start, loff_t end,
 {
 	int err;
 	struct file *lower_file;
-	struct path lower_path;
-	struct dentry *dentry = file->f_path.dentry;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
 
 	err = __generic_file_fsync(file, start, end, datasync);
 	if (err)
 		goto out;
 	lower_file = trfs_lower_file(file);
-	trfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
-	trfs_put_lower_path(dentry, &lower_path);
 out:
+	/* the range and datasync flag let replay issue the same barrier */
+	trfs_end_range(file);
+	if (trfs_traced(sb_info, file_inode(file), TRFS_TRACE_FSYNC) && open_record_id != -1 &&
+	    !trfs_record_begin(sb_info, &rec, 'f', TRFS_REC_HDR_SIZE +
+			       sizeof(open_record_id) + 2 * sizeof(s64) +
+			       sizeof(datasync) + sizeof(err))) {
+		s64 range[2] = { start, end };
+
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, range, sizeof(range));
+		trfs_record_put(&rec, &datasync, sizeof(datasync));
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
 	return err;
 }
 
@@ -673,8 +1029,12 @@ static int trfs_fasync(int fd, struct file *file, int flag)
  */
 static loff_t trfs_file_llseek(struct file *file, loff_t offset, int whence)
 {
-	int err;
+	loff_t err;
 	struct file *lower_file;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+	s64 pos[2];
 
 	err = generic_file_llseek(file, offset, whence);
 	if (err < 0)
@@ -684,23 +1044,248 @@ static loff_t trfs_file_llseek(struct file *file, loff_t offset, int whence)
 	err = generic_file_llseek(lower_file, offset, whence);
 
 out:
+	/* record the offset asked for and the resulting position */
+	trfs_end_range(file);
+	if (trfs_traced(sb_info, file_inode(file), TRFS_TRACE_LLSEEK) && open_record_id != -1 &&
+	    !trfs_record_begin(sb_info, &rec, 'S', TRFS_REC_HDR_SIZE +
+			       sizeof(open_record_id) + sizeof(whence) +
+			       sizeof(pos))) {
+		pos[0] = offset;
+		pos[1] = err;
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &whence, sizeof(whence));
+		trfs_record_put(&rec, pos, sizeof(pos));
+		trfs_record_end(&rec);
+	}
 	return err;
 }
 
+static long trfs_fallocate(struct file *file, int mode, loff_t offset,
+			   loff_t len)
+{
+	long err;
+	int ret;
+	struct file *lower_file;
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+	s64 range[2] = { offset, len };
+
+	lower_file = trfs_lower_file(file);
+	err = vfs_fallocate(lower_file, mode, offset, len);
+	if (!err) {
+		trfs_update_size_times(file_inode(file),
+				       file_inode(lower_file));
+	}
+
+	ret = err;
+	trfs_end_range(file);
+	if (trfs_traced(sb_info, file_inode(file), TRFS_TRACE_FALLOCATE) && open_record_id != -1 &&
+	    !trfs_record_begin(sb_info, &rec, 'a', TRFS_REC_HDR_SIZE +
+			       sizeof(open_record_id) + sizeof(mode) +
+			       sizeof(range) + sizeof(ret))) {
+		trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+		trfs_record_put(&rec, &mode, sizeof(mode));
+		trfs_record_put(&rec, range, sizeof(range));
+		trfs_record_put(&rec, &ret, sizeof(ret));
+		trfs_record_end(&rec);
+	}
+	return err;
+}
+
+/*
+ * Splices move pages through a pipe, and iter I/O (readv/writev, aio,
+ * O_DIRECT through the iter path) may complete after we return, so
+ * neither has a user buffer to take a payload from.  They are traced as
+ * the range alone: as a read or a write into the file's run when
+ * coalescing, else as a @type record, 'P' for splices, 'v' for iter I/O.
+ * Reads carry their page cache probe, writes 0 pages.
+ */
+static void trfs_trace_span(struct file *file, char type, char dir, s64 pos,
+			    size_t len, ssize_t ret, u32 pages, u32 cached)
+{
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+	u64 count = len;
+	s64 result = ret;
+
+	if (!trfs_traced(sb_info, file_inode(file), dir == 'w' ?
+			 TRFS_TRACE_WRITE : TRFS_TRACE_READ) ||
+	    trfs_coalesce(file, dir, pos, ret, pages, cached))
+		return;
+	if (trfs_record_begin(sb_info, &rec, type, TRFS_REC_HDR_SIZE +
+			      sizeof(open_record_id) + sizeof(dir) +
+			      sizeof(pos) + sizeof(count) + sizeof(result) +
+			      sizeof(pages) + sizeof(cached)))
+		return;
+	trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+	trfs_record_put(&rec, &dir, sizeof(dir));
+	trfs_record_put(&rec, &pos, sizeof(pos));
+	trfs_record_put(&rec, &count, sizeof(count));
+	trfs_record_put(&rec, &result, sizeof(result));
+	trfs_record_put(&rec, &pages, sizeof(pages));
+	trfs_record_put(&rec, &cached, sizeof(cached));
+	trfs_record_end(&rec);
+}
+
 /*
- * Trfs read_iter, redirect modified iocb to lower read_iter
+ * Splice (and sendfile, which splices through an internal pipe) goes
+ * straight to the lower file's splice methods, so pages are not copied
+ * through trfs_read/trfs_write.
+ */
+static ssize_t trfs_splice_read(struct file *file, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file = trfs_lower_file(file);
+	s64 pos = *ppos;
+	u32 pages, cached;
+
+	if (!lower_file->f_op->splice_read)
+		return -EINVAL;
+	trfs_probe_cache(file, lower_file, pos, len, &pages, &cached);
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len,
+					    flags);
+	if (err >= 0)
+		trfs_update_atime(file_inode(file),
+				  file_inode(lower_file));
+
+	trfs_trace_span(file, 'P', 'r', pos, len, err, pages, cached);
+	return err;
+}
+
+static ssize_t trfs_splice_write(struct pipe_inode_info *pipe,
+				 struct file *file, loff_t *ppos, size_t len,
+				 unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file = trfs_lower_file(file);
+	s64 pos = *ppos;
+
+	if (!lower_file->f_op->splice_write)
+		return -EINVAL;
+	/* our caller only holds freeze protection on the upper sb */
+	file_start_write(lower_file);
+	err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len,
+					     flags);
+	file_end_write(lower_file);
+	if (err >= 0) {
+		trfs_update_size_times(file_inode(file),
+				       file_inode(lower_file));
+	}
+
+	trfs_trace_span(file, 'P', 'w', pos, len, err, 0, 0);
+	return err;
+}
+
+/*
+ * A 'y' (copy_file_range) or 'L' (clone) record: both files and offsets,
+ * the length asked for and the result, no data.
+ */
+static void trfs_trace_copy(char type, struct file *file_in, s64 pos_in,
+			    struct file *file_out, s64 pos_out, u64 len,
+			    s64 result)
+{
+	struct trfs_sb_info *sb_info = TRFS_SB(file_out->f_inode->i_sb);
+	struct trfs_record rec;
+	int in_record_id = TRFS_F(file_in)->record_id;
+	int out_record_id = TRFS_F(file_out)->record_id;
+
+	trfs_end_range(file_in);
+	trfs_end_range(file_out);
+	if (!trfs_traced(sb_info, file_inode(file_out), TRFS_TRACE_COPY) ||
+	    trfs_record_begin(sb_info, &rec, type, TRFS_REC_HDR_SIZE +
+			      sizeof(in_record_id) + sizeof(pos_in) +
+			      sizeof(out_record_id) + sizeof(pos_out) +
+			      sizeof(len) + sizeof(result)))
+		return;
+	trfs_record_put(&rec, &in_record_id, sizeof(in_record_id));
+	trfs_record_put(&rec, &pos_in, sizeof(pos_in));
+	trfs_record_put(&rec, &out_record_id, sizeof(out_record_id));
+	trfs_record_put(&rec, &pos_out, sizeof(pos_out));
+	trfs_record_put(&rec, &len, sizeof(len));
+	trfs_record_put(&rec, &result, sizeof(result));
+	trfs_record_end(&rec);
+}
+
+/*
+ * The vfs only calls these with both files on the same sb, so both are
+ * trfs files over the same lower mount and the lower fs can copy or
+ * share extents itself.  If it can't copy, vfs_copy_file_range splices.
+ */
+static ssize_t trfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				    struct file *file_out, loff_t pos_out,
+				    size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_in = trfs_lower_file(file_in);
+	struct file *lower_out = trfs_lower_file(file_out);
+
+	err = vfs_copy_file_range(lower_in, pos_in, lower_out, pos_out,
+				  len, flags);
+	if (err >= 0) {
+		trfs_update_atime(file_inode(file_in),
+				  file_inode(lower_in));
+		trfs_update_size_times(file_inode(file_out),
+				       file_inode(lower_out));
+	}
+
+	trfs_trace_copy('y', file_in, pos_in, file_out, pos_out, len, err);
+	return err;
+}
+
+static int trfs_clone_file_range(struct file *file_in, loff_t pos_in,
+				 struct file *file_out, loff_t pos_out,
+				 u64 len)
+{
+	int err;
+	struct file *lower_in = trfs_lower_file(file_in);
+	struct file *lower_out = trfs_lower_file(file_out);
+
+	err = vfs_clone_file_range(lower_in, pos_in, lower_out, pos_out, len);
+	if (!err) {
+		trfs_update_size_times(file_inode(file_out),
+				       file_inode(lower_out));
+	}
+
+	/*
+	 * vfs_copy_file_range() tries a clone before ->copy_file_range, so
+	 * a clone the lower fs can't do is most likely copy_file_range(2)
+	 * about to fall back to a copy, which gets its own 'y' record.
+	 */
+	if (err != -EOPNOTSUPP && err != -EXDEV)
+		trfs_trace_copy('L', file_in, pos_in, file_out, pos_out,
+				len, err);
+	return err;
+}
+
+/*
+ * Trfs read_iter, redirect modified iocb to lower read_iter.  This is how
+ * readv, aio and O_DIRECT iter I/O reach the lower file, which does the
+ * direct I/O itself, so its alignment rules hold unchanged.
  */
 ssize_t
 trfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
+	ssize_t err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	s64 pos = iocb->ki_pos;
+	size_t len = iov_iter_count(iter);
+	u32 pages = 0, cached = 0;
 
 	lower_file = trfs_lower_file(file);
 	if (!lower_file->f_op->read_iter) {
 		err = -EINVAL;
 		goto out;
 	}
+	err = trfs_sync_flags(file, lower_file);
+	if (err)
+		goto out;
+	trfs_probe_cache(file, lower_file, pos,
+			 iocb->ki_flags & IOCB_DIRECT ? 0 : len,
+			 &pages, &cached);
 
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
@@ -709,9 +1294,10 @@ trfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	fput(lower_file);
 	/* update upper inode atime as needed */
 	if (err >= 0 || err == -EIOCBQUEUED)
-		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
+		trfs_update_atime(d_inode(file->f_path.dentry),
+				  file_inode(lower_file));
 out:
+	trfs_trace_span(file, 'v', 'r', pos, len, err, pages, cached);
 	return err;
 }
 
@@ -721,34 +1307,41 @@ out:
 ssize_t
 trfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
+	ssize_t err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	s64 pos = iocb->ki_pos;
+	size_t len = iov_iter_count(iter);
 
 	lower_file = trfs_lower_file(file);
 	if (!lower_file->f_op->write_iter) {
 		err = -EINVAL;
 		goto out;
 	}
+	err = trfs_sync_flags(file, lower_file);
+	if (err)
+		goto out;
 
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->write_iter(iocb, iter);
 	iocb->ki_filp = file;
 	fput(lower_file);
+	/* IOCB_APPEND writes land at eof, not at the offset passed in */
+	if (err > 0)
+		pos = iocb->ki_pos - err;
 	/* update upper inode times/sizes as needed */
 	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
+		trfs_update_size_times(d_inode(file->f_path.dentry),
+				       file_inode(lower_file));
 	}
 out:
+	trfs_trace_span(file, 'v', 'w', pos, len, err, 0, 0);
 	return err;
 }
 
 
 const struct file_operations trfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= trfs_file_llseek,
 	.read		= trfs_read,
 	.write		= trfs_write,
 	.unlocked_ioctl	= trfs_unlocked_ioctl,
@@ -761,8 +1354,13 @@ const struct file_operations trfs_main_fops = {
 	.release	= trfs_file_release,
 	.fsync		= trfs_fsync,
 	.fasync		= trfs_fasync,
+	.fallocate	= trfs_fallocate,
 	.read_iter	= trfs_read_iter,
 	.write_iter	= trfs_write_iter,
+	.splice_read	= trfs_splice_read,
+	.splice_write	= trfs_splice_write,
+	.copy_file_range = trfs_copy_file_range,
+	.clone_file_range = trfs_clone_file_range,
 };
 
 /* trimmed directory options */
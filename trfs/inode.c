@@ -11,18 +11,6 @@
 
 #include "trfs.h"
 
-static int write_file(struct file *file,char *buff, int len){
-	int ret;
-	mm_segment_t fs;
-	fs = get_fs();
-	set_fs(get_ds());
-	
-	ret = vfs_write(file,buff,len,&file->f_pos);
-
-	set_fs(fs);
-	return ret;
-}
-
 static int trfs_create(struct inode *dir, struct dentry *dentry,
 			 umode_t mode, bool want_excl)
 {
@@ -30,6 +18,15 @@ static int trfs_create(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *path = NULL;
+	char type = 'C';
+
+	if (trfs_traced(sb_info, dir, TRFS_TRACE_CREATE)) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	}
 
 	trfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -48,6 +45,17 @@ static int trfs_create(struct inode *dir, struct dentry *dentry,
 out:
 	unlock_dir(lower_parent_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
+
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + sizeof(mode) +
+			trfs_path_size(path) + sizeof(err))) {
+		trfs_record_put(&rec, &mode, sizeof(mode));
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -60,6 +68,20 @@ static int trfs_link(struct dentry *old_dentry, struct inode *dir,
 	u64 file_size_save;
 	int err;
 	struct path lower_old_path, lower_new_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *old_path = NULL, *new_path = NULL;
+	char type = 'l';
+
+	/* both paths share one staging buffer, half each */
+	if (trfs_traced(sb_info, dir, TRFS_TRACE_LINK)) {
+		buffer = trfs_staging_alloc();
+		old_path = trfs_record_path(old_dentry, buffer,
+					    TRFS_MAX_RECORD / 2);
+		new_path = trfs_record_path(new_dentry,
+					    buffer + TRFS_MAX_RECORD / 2,
+					    TRFS_MAX_RECORD / 2);
+	}
 
 	file_size_save = i_size_read(d_inode(old_dentry));
 	trfs_get_lower_path(old_dentry, &lower_old_path);
@@ -85,6 +107,17 @@ out:
 	unlock_dir(lower_dir_dentry);
 	trfs_put_lower_path(old_dentry, &lower_old_path);
 	trfs_put_lower_path(new_dentry, &lower_new_path);
+
+	if (old_path && new_path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(old_path) +
+			trfs_path_size(new_path) + sizeof(err))) {
+		trfs_record_put_path(&rec, old_path);
+		trfs_record_put_path(&rec, new_path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -95,6 +128,15 @@ static int trfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct inode *lower_dir_inode = trfs_lower_inode(dir);
 	struct dentry *lower_dir_dentry;
 	struct path lower_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *path = NULL;
+	char type = 'u';
+
+	if (trfs_traced(sb_info, dir, TRFS_TRACE_UNLINK)) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	}
 
 	trfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -124,6 +166,16 @@ out:
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
+
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(path) +
+			sizeof(err))) {
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -134,6 +186,15 @@ static int trfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *path = NULL;
+	char type = 's';
+
+	if (trfs_traced(sb_info, dir, TRFS_TRACE_SYMLINK)) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	}
 
 	trfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -151,6 +212,18 @@ static int trfs_symlink(struct inode *dir, struct dentry *dentry,
 out:
 	unlock_dir(lower_parent_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
+
+	/* the link target is recorded as is, it isn't a trfs path */
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(symname) +
+			trfs_path_size(path) + sizeof(err))) {
+		trfs_record_put_path(&rec, symname);
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -162,32 +235,22 @@ static int trfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	struct path lower_path;
 	int ioctl_flag;
 
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)dir->i_sb->s_fs_info;
-
-	
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
 
-	char *buffer, *path;
+	char *buffer = NULL, *path = NULL;
 	
 	char type = 'm';
-	char *buffcpy = sb_info->buffer;
-	u16 size=sizeof(size);
-	u16 path_size;
 
-	if(sb_info->bitmap & 0x40)
+	if(trfs_traced(sb_info, dir, TRFS_TRACE_MKDIR))
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 	
-	//using dentry_path_raw function to get the relative path of the directory
-
-	buffer = (char *)__get_free_page(GFP_KERNEL);
-	path = dentry_path_raw(dentry, buffer, PAGE_SIZE);
-	
-	if(path){
-		if(strlen(path)>1){
-			path = path + 1;	
-			size = size + sizeof(sb_info->record_id) + sizeof(type) + sizeof(mode) + sizeof(path_size) + strlen(path) + 1 + sizeof(err);
-		}
+	//relative path of the directory which will be used in treplay
+	if (ioctl_flag) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
 	}
 	
 	trfs_get_lower_path(dentry, &lower_path);
@@ -211,51 +274,16 @@ out:
 	unlock_dir(lower_parent_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
 
-	mutex_lock(&sb_info->buffer_lock);
-	if(ioctl_flag){
-		if(size<4096 && size>sizeof(size)){
-			memcpy(sb_info->buffer,&size,sizeof(size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-
-			sb_info->record_id = sb_info->record_id + 1;
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-
-			memcpy(sb_info->buffer,&type,sizeof(type));
-
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			memcpy(sb_info->buffer,&mode,sizeof(mode));
-
-			sb_info->buffer = sb_info->buffer + sizeof(mode);
-
-			path_size = strlen(path) + 1;
-
-			memcpy(sb_info->buffer,&path_size,sizeof(path_size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(path_size);
-
-			memcpy(sb_info->buffer,path,strlen(path) + 1);
-
-			sb_info->buffer = sb_info->buffer + strlen(path) + 1;
-
-			memcpy(sb_info->buffer,&err,sizeof(err));
-
-			sb_info->buffer = sb_info->buffer + sizeof(err);
-
-
-			write_file(sb_info->tf,buffcpy,size);
-
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-
-		}
-	}	
-	mutex_unlock(&sb_info->buffer_lock);
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + sizeof(mode) +
+			trfs_path_size(path) + sizeof(err))) {
+		trfs_record_put(&rec, &mode, sizeof(mode));
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
 
-	free_page((unsigned long)buffer);
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -267,30 +295,21 @@ static int trfs_rmdir(struct inode *dir, struct dentry *dentry)
 	struct path lower_path;
 	int ioctl_flag;
 
-	struct trfs_sb_info *sb_info = (struct trfs_sb_info *)dir->i_sb->s_fs_info;
-
-	
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
 
-	char *buffer, *path;
+	char *buffer = NULL, *path = NULL;
 	
 	char type = 'R';
-	char *buffcpy = sb_info->buffer;
-	u16 size=sizeof(size);
-	u16 path_size;
 	
-	if(sb_info->bitmap & 0x80)
+	if(trfs_traced(sb_info, dir, TRFS_TRACE_RMDIR))
 		ioctl_flag = 1;
 	else
 		ioctl_flag = 0;
 
-	buffer = (char *)__get_free_page(GFP_KERNEL);
-	path = dentry_path_raw(dentry, buffer, PAGE_SIZE);
-
-	if(path){
-		if(strlen(path)>1){
-			path = path + 1;
-			size = size + sizeof(sb_info->record_id) + sizeof(type)  + sizeof(path_size) + strlen(path) + 1 + sizeof(err);
-		}
+	if (ioctl_flag) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
 	}
 
 	trfs_get_lower_path(dentry, &lower_path);
@@ -312,48 +331,15 @@ out:
 	unlock_dir(lower_dir_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
 
-	//printk("rid: %d\n",sb_info->record_id);
-	mutex_lock(&sb_info->buffer_lock);
-	if(ioctl_flag){
-		if(size<4096 && size>sizeof(size)){
-			memcpy(sb_info->buffer,&size,sizeof(size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(size);
-
-			memcpy(sb_info->buffer,&(sb_info->record_id),sizeof(sb_info->record_id));
-
-			sb_info->record_id = sb_info->record_id + 1;
-			sb_info->buffer = sb_info->buffer + sizeof(sb_info->record_id);
-
-			memcpy(sb_info->buffer,&type,sizeof(type));
-
-			sb_info->buffer = sb_info->buffer + sizeof(type);
-
-			path_size = strlen(path) + 1;
-
-			memcpy(sb_info->buffer,&path_size,sizeof(path_size));
-
-			sb_info->buffer = sb_info->buffer + sizeof(path_size);
-
-			memcpy(sb_info->buffer,path,strlen(path) + 1);
-
-			sb_info->buffer = sb_info->buffer + strlen(path) + 1;
-
-			memcpy(sb_info->buffer,&err,sizeof(err));
-
-			sb_info->buffer = sb_info->buffer + sizeof(err);
-
-
-			write_file(sb_info->tf,buffcpy,size);
-
-			sb_info->buffer = buffcpy;
-			memset(sb_info->buffer,0,4096);
-
-		}
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(path) +
+			sizeof(err))) {
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
 	}
-	mutex_unlock(&sb_info->buffer_lock);
 
-	free_page((unsigned long)buffer);
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -364,6 +350,16 @@ static int trfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *path = NULL;
+	char type = 'K';
+	u32 rdev = new_encode_dev(dev);
+
+	if (trfs_traced(sb_info, dir, TRFS_TRACE_MKNOD)) {
+		buffer = trfs_staging_alloc();
+		path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	}
 
 	trfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -382,6 +378,18 @@ static int trfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 out:
 	unlock_dir(lower_parent_dentry);
 	trfs_put_lower_path(dentry, &lower_path);
+
+	if (path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + sizeof(mode) + sizeof(rdev) +
+			trfs_path_size(path) + sizeof(err))) {
+		trfs_record_put(&rec, &mode, sizeof(mode));
+		trfs_record_put(&rec, &rdev, sizeof(rdev));
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -399,6 +407,20 @@ static int trfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
 	struct path lower_old_path, lower_new_path;
+	struct trfs_sb_info *sb_info = TRFS_SB(old_dir->i_sb);
+	struct trfs_record rec;
+	char *buffer = NULL, *old_path = NULL, *new_path = NULL;
+	char type = 'N';
+
+	/* both paths share one staging buffer, half each */
+	if (trfs_traced(sb_info, old_dir, TRFS_TRACE_RENAME)) {
+		buffer = trfs_staging_alloc();
+		old_path = trfs_record_path(old_dentry, buffer,
+					    TRFS_MAX_RECORD / 2);
+		new_path = trfs_record_path(new_dentry,
+					    buffer + TRFS_MAX_RECORD / 2,
+					    TRFS_MAX_RECORD / 2);
+	}
 
 	trfs_get_lower_path(old_dentry, &lower_old_path);
 	trfs_get_lower_path(new_dentry, &lower_new_path);
@@ -440,6 +462,17 @@ out:
 	dput(lower_new_dir_dentry);
 	trfs_put_lower_path(old_dentry, &lower_old_path);
 	trfs_put_lower_path(new_dentry, &lower_new_path);
+
+	if (old_path && new_path && !trfs_record_begin(sb_info, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(old_path) +
+			trfs_path_size(new_path) + sizeof(err))) {
+		trfs_record_put_path(&rec, old_path);
+		trfs_record_put_path(&rec, new_path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+
+	trfs_staging_free(buffer);
 	return err;
 }
 
@@ -506,10 +539,63 @@ static int trfs_permission(struct inode *inode, int mask)
 	int err;
 
 	lower_inode = trfs_lower_inode(inode);
+	/* only RCU-walk (MAY_NOT_BLOCK) can see an inode being evicted */
+	if (unlikely(!lower_inode))
+		return -ECHILD;
 	err = inode_permission(lower_inode, mask);
 	return err;
 }
 
+/*
+ * Setattr records keep the attributes that replay can reproduce: mode,
+ * owner, size (truncate) and times.  Times left to the clock are replayed
+ * as UTIME_NOW, so only the *_SET ones carry a meaningful value.
+ */
+static void trfs_trace_setattr(struct trfs_sb_info *sbi,
+			       struct dentry *dentry, struct iattr *ia, int err)
+{
+	struct trfs_record rec;
+	char *buffer, *path;
+	u32 valid, uid, gid, nsec;
+	u16 mode;
+	s64 size, sec;
+
+	buffer = trfs_staging_alloc();
+	path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	if (!path || trfs_record_begin(sbi, &rec, 'A',
+			TRFS_REC_HDR_SIZE + sizeof(valid) + sizeof(mode) +
+			sizeof(uid) + sizeof(gid) + sizeof(size) +
+			2 * (sizeof(sec) + sizeof(nsec)) +
+			trfs_path_size(path) + sizeof(err)))
+		goto out;
+
+	valid = ia->ia_valid & (ATTR_MODE | ATTR_UID | ATTR_GID | ATTR_SIZE |
+				ATTR_ATIME | ATTR_MTIME | ATTR_ATIME_SET |
+				ATTR_MTIME_SET);
+	mode = ia->ia_mode;
+	uid = from_kuid(&init_user_ns, ia->ia_uid);
+	gid = from_kgid(&init_user_ns, ia->ia_gid);
+	size = ia->ia_size;
+	trfs_record_put(&rec, &valid, sizeof(valid));
+	trfs_record_put(&rec, &mode, sizeof(mode));
+	trfs_record_put(&rec, &uid, sizeof(uid));
+	trfs_record_put(&rec, &gid, sizeof(gid));
+	trfs_record_put(&rec, &size, sizeof(size));
+	sec = ia->ia_atime.tv_sec;
+	nsec = ia->ia_atime.tv_nsec;
+	trfs_record_put(&rec, &sec, sizeof(sec));
+	trfs_record_put(&rec, &nsec, sizeof(nsec));
+	sec = ia->ia_mtime.tv_sec;
+	nsec = ia->ia_mtime.tv_nsec;
+	trfs_record_put(&rec, &sec, sizeof(sec));
+	trfs_record_put(&rec, &nsec, sizeof(nsec));
+	trfs_record_put_path(&rec, path);
+	trfs_record_put(&rec, &err, sizeof(err));
+	trfs_record_end(&rec);
+out:
+	trfs_staging_free(buffer);
+}
+
 static int trfs_setattr(struct dentry *dentry, struct iattr *ia)
 {
 	int err;
@@ -585,6 +671,8 @@ static int trfs_setattr(struct dentry *dentry, struct iattr *ia)
 out:
 	trfs_put_lower_path(dentry, &lower_path);
 out_err:
+	if (trfs_traced(TRFS_SB(dentry->d_sb), d_inode(dentry), TRFS_TRACE_SETATTR))
+		trfs_trace_setattr(TRFS_SB(dentry->d_sb), dentry, ia, err);
 	return err;
 }
 
@@ -594,8 +682,10 @@ static int trfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 	int err;
 	struct kstat lower_stat;
 	struct path lower_path;
+	struct trfs_sb_info *sbi;
 
-	trfs_get_lower_path(dentry, &lower_path);
+	/* stat storms hit popular files hardest, so take no references */
+	trfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_getattr(&lower_path, &lower_stat);
 	if (err)
 		goto out;
@@ -604,10 +694,56 @@ static int trfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 	generic_fillattr(d_inode(dentry), stat);
 	stat->blocks = lower_stat.blocks;
 out:
-	trfs_put_lower_path(dentry, &lower_path);
+
+	/* stat storms would swamp the trace, so getattr can be sampled */
+	sbi = TRFS_SB(dentry->d_sb);
+	if (trfs_traced(sbi, d_inode(dentry), TRFS_TRACE_GETATTR) &&
+	    trfs_sample(sbi->getattr_count, sbi->getattr_sample))
+		trfs_trace_path_op(sbi, 'T', dentry, err);
 	return err;
 }
 
+/*
+ * All four xattr ops share one record layout: flags, the value size
+ * asked for, the value itself (setxattr only, cut to fit a record), the
+ * attribute name in path format ("" for listxattr), path and result.
+ */
+static void trfs_trace_xattr(struct dentry *dentry, char type,
+			     const char *name, const void *value,
+			     size_t size, int flags, int err)
+{
+	struct trfs_record rec;
+	char *buffer, *path;
+	size_t fixed;
+	u32 req = size, stored = 0;
+
+	buffer = trfs_staging_alloc();
+	path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	if (!path)
+		goto out;
+	if (!name)
+		name = "";
+	fixed = TRFS_REC_HDR_SIZE + sizeof(flags) + sizeof(req) +
+		sizeof(stored) + trfs_path_size(name) +
+		trfs_path_size(path) + sizeof(err);
+	if (value && fixed < TRFS_MAX_RECORD)
+		stored = min_t(size_t, size, TRFS_MAX_RECORD - 1 - fixed);
+
+	if (trfs_record_begin(TRFS_SB(dentry->d_sb), &rec, type,
+			      fixed + stored))
+		goto out;
+	trfs_record_put(&rec, &flags, sizeof(flags));
+	trfs_record_put(&rec, &req, sizeof(req));
+	trfs_record_put(&rec, &stored, sizeof(stored));
+	trfs_record_put(&rec, value, stored);
+	trfs_record_put_path(&rec, name);
+	trfs_record_put_path(&rec, path);
+	trfs_record_put(&rec, &err, sizeof(err));
+	trfs_record_end(&rec);
+out:
+	trfs_staging_free(buffer);
+}
+
 static int
 trfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 		size_t size, int flags)
@@ -626,8 +762,15 @@ trfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry),
 			      d_inode(lower_path.dentry));
+	/* an invalid value counts as none, as at lookup */
+	if (S_ISDIR(d_inode(dentry)->i_mode) &&
+	    !strcmp(name, TRFS_POLICY_XATTR))
+		trfs_change_policy(d_inode(dentry),
+				   trfs_parse_policy(value, size));
 out:
 	trfs_put_lower_path(dentry, &lower_path);
+	if (trfs_traced(TRFS_SB(dentry->d_sb), d_inode(dentry), TRFS_TRACE_XATTR))
+		trfs_trace_xattr(dentry, 'X', name, value, size, flags, err);
 	return err;
 }
 
@@ -639,7 +782,7 @@ trfs_getxattr(struct dentry *dentry, const char *name, void *buffer,
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
-	trfs_get_lower_path(dentry, &lower_path);
+	trfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!d_inode(lower_dentry)->i_op->getxattr) {
 		err = -EOPNOTSUPP;
@@ -651,7 +794,8 @@ trfs_getxattr(struct dentry *dentry, const char *name, void *buffer,
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
 out:
-	trfs_put_lower_path(dentry, &lower_path);
+	if (trfs_traced(TRFS_SB(dentry->d_sb), d_inode(dentry), TRFS_TRACE_XATTR))
+		trfs_trace_xattr(dentry, 'x', name, NULL, size, 0, err);
 	return err;
 }
 
@@ -662,7 +806,7 @@ trfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
-	trfs_get_lower_path(dentry, &lower_path);
+	trfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!d_inode(lower_dentry)->i_op->listxattr) {
 		err = -EOPNOTSUPP;
@@ -674,7 +818,8 @@ trfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
 out:
-	trfs_put_lower_path(dentry, &lower_path);
+	if (trfs_traced(TRFS_SB(dentry->d_sb), d_inode(dentry), TRFS_TRACE_XATTR))
+		trfs_trace_xattr(dentry, 'i', NULL, NULL, buffer_size, 0, err);
 	return err;
 }
 
@@ -697,8 +842,13 @@ trfs_removexattr(struct dentry *dentry, const char *name)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry),
 			      d_inode(lower_path.dentry));
+	if (S_ISDIR(d_inode(dentry)->i_mode) &&
+	    !strcmp(name, TRFS_POLICY_XATTR))
+		trfs_change_policy(d_inode(dentry), TRFS_POLICY_NONE);
 out:
 	trfs_put_lower_path(dentry, &lower_path);
+	if (trfs_traced(TRFS_SB(dentry->d_sb), d_inode(dentry), TRFS_TRACE_XATTR))
+		trfs_trace_xattr(dentry, 'z', name, NULL, 0, 0, err);
 	return err;
 }
 const struct inode_operations trfs_symlink_iops = {
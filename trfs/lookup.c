@@ -26,16 +26,31 @@ int trfs_init_dentry_cache(void)
 
 void trfs_destroy_dentry_cache(void)
 {
+	/* wait for the dentry infos still queued by free_dentry_private_data */
+	rcu_barrier();
 	if (trfs_dentry_cachep)
 		kmem_cache_destroy(trfs_dentry_cachep);
 }
 
+static void trfs_free_dentry_info(struct rcu_head *head)
+{
+	kmem_cache_free(trfs_dentry_cachep,
+			container_of(head, struct trfs_dentry_info, rcu));
+}
+
+/*
+ * RCU-walk revalidates read d_fsdata without a reference on the dentry,
+ * so the info is only freed once they are done with it.
+ */
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct trfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(trfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	info = dentry->d_fsdata;
+	WRITE_ONCE(dentry->d_fsdata, NULL);
+	call_rcu(&info->rcu, trfs_free_dentry_info);
 }
 
 /* allocate new dentry private data */
@@ -48,7 +63,7 @@ int new_dentry_private_data(struct dentry *dentry)
 	if (!info)
 		return -ENOMEM;
 
-	spin_lock_init(&info->lock);
+	seqlock_init(&info->lock);
 	dentry->d_fsdata = info;
 
 	return 0;
@@ -143,6 +158,128 @@ struct inode *trfs_iget(struct super_block *sb, struct inode *lower_inode)
 	return inode;
 }
 
+/*
+ * Parse a TRFS_POLICY_XATTR value, returns the policy or -EINVAL.  A
+ * trailing newline is allowed so "setfattr -v" and "echo" both work.
+ */
+int trfs_parse_policy(const char *value, size_t len)
+{
+	static const char * const names[] = {
+		[TRFS_POLICY_ALL] = "all",
+		[TRFS_POLICY_META] = "meta",
+		[TRFS_POLICY_OFF] = "off",
+	};
+	int i;
+
+	if (len && value[len - 1] == '\n')
+		len--;
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (len == strlen(names[i]) && !memcmp(value, names[i], len))
+			return i;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Record that @inode, a directory, now has policy @own_policy of its own
+ * (TRFS_POLICY_NONE for none) and make every cached inode work its
+ * policy out again, so the change reaches the subtree already cached.
+ */
+void trfs_change_policy(struct inode *inode, int own_policy)
+{
+	if (own_policy < 0)
+		own_policy = TRFS_POLICY_NONE;
+	WRITE_ONCE(TRFS_I(inode)->own_policy, own_policy);
+	smp_wmb();	/* the new policy before the new generation */
+	atomic_inc(&TRFS_SB(inode->i_sb)->policy_gen);
+}
+
+/*
+ * Work out again the policy in effect for @inode, after a policy change:
+ * the own policy of the nearest directory above it (itself included)
+ * that has one, else TRFS_POLICY_ALL.  The walk up goes through any
+ * alias of @inode; an inode without one keeps its policy.
+ *
+ * Returns the policy, now cached with the current generation.
+ */
+int trfs_refresh_policy(struct inode *inode)
+{
+	struct trfs_inode_info *ii = TRFS_I(inode);
+	unsigned int gen = atomic_read(&TRFS_SB(inode->i_sb)->policy_gen);
+	int policy = TRFS_POLICY_ALL, own;
+	struct dentry *alias, *dentry;
+	struct inode *dir;
+
+	smp_rmb();	/* own policies at least as new as @gen */
+	alias = d_find_any_alias(inode);
+	if (!alias)
+		return READ_ONCE(ii->policy);
+
+	rcu_read_lock();
+	for (dentry = alias; ; dentry = READ_ONCE(dentry->d_parent)) {
+		dir = READ_ONCE(dentry->d_inode);
+		if (!dir)
+			break;
+		own = READ_ONCE(TRFS_I(dir)->own_policy);
+		if (own != TRFS_POLICY_NONE) {
+			policy = own;
+			break;
+		}
+		if (IS_ROOT(dentry))
+			break;
+	}
+	rcu_read_unlock();
+	dput(alias);
+
+	WRITE_ONCE(ii->policy, policy);
+	smp_wmb();	/* pairs with trfs_inode_policy() */
+	WRITE_ONCE(ii->policy_gen, gen);
+	return policy;
+}
+
+/*
+ * Cache the trace policy in effect for @inode: the one set on its lower
+ * directory, if any, else the one of @parent (NULL for the root).  Only
+ * directories carry policies, so looking up files never costs an xattr
+ * read.  The xattr is read straight from the lower ->getxattr, as the
+ * mounter would: without the permission and LSM checks against the task
+ * doing the lookup, whose rights must not decide the policy.
+ */
+void trfs_set_policy(struct inode *inode, struct dentry *lower_dentry,
+		     struct inode *parent)
+{
+	struct trfs_inode_info *ii = TRFS_I(inode);
+	struct inode *lower_inode = d_inode(lower_dentry);
+	unsigned int gen = atomic_read(&TRFS_SB(inode->i_sb)->policy_gen);
+	int own = TRFS_POLICY_NONE, parent_policy;
+	char value[8];
+	ssize_t len;
+
+	/* a change from here on leaves @gen stale, to be refreshed */
+	smp_rmb();
+	parent_policy = parent ? trfs_inode_policy(parent) : TRFS_POLICY_ALL;
+
+	if (S_ISDIR(inode->i_mode)) {
+		len = -EOPNOTSUPP;
+		if (lower_inode->i_op->getxattr)
+			len = lower_inode->i_op->getxattr(lower_dentry,
+							  TRFS_POLICY_XATTR,
+							  value, sizeof(value));
+		if (len > 0)
+			own = trfs_parse_policy(value, len);
+	}
+	/* an invalid value is none; a new or changed one reaches the subtree */
+	if (own < 0)
+		own = TRFS_POLICY_NONE;
+	if (own != ii->own_policy)
+		trfs_change_policy(inode, own);
+
+	ii->policy = ii->own_policy != TRFS_POLICY_NONE ? ii->own_policy :
+			parent_policy;
+	smp_wmb();	/* pairs with trfs_inode_policy() */
+	ii->policy_gen = gen;
+}
+
 /*
  * Helper interpose routine, called directly by ->lookup to handle
  * spliced dentries.
@@ -176,8 +313,19 @@ static struct dentry *__trfs_interpose(struct dentry *dentry,
 		ret_dentry = ERR_PTR(PTR_ERR(inode));
 		goto out;
 	}
+	trfs_set_policy(inode, lower_path->dentry,
+			d_inode(dentry->d_parent));
 
-	ret_dentry = d_splice_alias(inode, dentry);
+	/*
+	 * A dentry fresh from lookup is unhashed; one that create, mkdir,
+	 * etc. are turning positive was hashed by lookup as a negative one.
+	 */
+	if (d_unhashed(dentry)) {
+		ret_dentry = d_splice_alias(inode, dentry);
+	} else {
+		d_instantiate(dentry, inode);
+		ret_dentry = NULL;
+	}
 
 out:
 	return ret_dentry;
@@ -216,7 +364,6 @@ static struct dentry *__trfs_lookup(struct dentry *dentry,
 	struct dentry *lower_dentry;
 	const char *name;
 	struct path lower_path;
-	struct qstr this;
 	struct dentry *ret_dentry = NULL;
 
 	/* must initialize dentry operations */
@@ -231,13 +378,30 @@ static struct dentry *__trfs_lookup(struct dentry *dentry,
 	lower_dir_dentry = lower_parent_path->dentry;
 	lower_dir_mnt = lower_parent_path->mnt;
 
-	/* Use vfs_path_lookup to check if the dentry exists or not */
-	err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, name, 0,
-			      &lower_path);
+	/*
+	 * Cached lower dentries, negative ones included, are found without
+	 * taking the lower directory's lock; only a miss locks it to ask the
+	 * lower fs.  Either way we get a hashed dentry, positive or not.
+	 */
+	lower_dentry = lookup_one_len_unlocked(name, lower_dir_dentry,
+					       dentry->d_name.len);
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
+		goto out;
+	}
+	/* beyond a lower mount point is another sb, which we don't cross */
+	if (d_mountpoint(lower_dentry)) {
+		dput(lower_dentry);
+		err = -EXDEV;
+		goto out;
+	}
+
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_dir_mnt);
+	trfs_set_lower_path(dentry, &lower_path);
 
-	/* no error: handle positive dentries */
-	if (!err) {
-		trfs_set_lower_path(dentry, &lower_path);
+	/* handle positive dentries */
+	if (d_really_is_positive(lower_dentry)) {
 		ret_dentry =
 			__trfs_interpose(dentry, dentry->d_sb, &lower_path);
 		if (IS_ERR(ret_dentry)) {
@@ -249,39 +413,12 @@ static struct dentry *__trfs_lookup(struct dentry *dentry,
 	}
 
 	/*
-	 * We don't consider ENOENT an error, and we want to return a
-	 * negative dentry.
+	 * Negative: we don't consider ENOENT an error, and return a negative
+	 * dentry, also so that a create or rename can turn it positive.  It
+	 * is hashed, so repeated misses are answered from the dcache while
+	 * the lower dentry stays negative (see trfs_d_revalidate).
 	 */
-	if (err && err != -ENOENT)
-		goto out;
-
-	/* instatiate a new negative dentry */
-	this.name = name;
-	this.len = strlen(name);
-	this.hash = full_name_hash(this.name, this.len);
-	lower_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_dentry)
-		goto setup_lower;
-
-	lower_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_dentry) {
-		err = -ENOMEM;
-		goto out;
-	}
-	d_add(lower_dentry, NULL); /* instantiate and hash */
-
-setup_lower:
-	lower_path.dentry = lower_dentry;
-	lower_path.mnt = mntget(lower_dir_mnt);
-	trfs_set_lower_path(dentry, &lower_path);
-
-	/*
-	 * If the intent is to create a file, then don't return an error, so
-	 * the VFS will continue the process of making this negative dentry
-	 * into a positive one.
-	 */
-	if (err == -ENOENT || (flags & (LOOKUP_CREATE|LOOKUP_RENAME_TARGET)))
-		err = 0;
+	d_add(dentry, NULL);
 
 out:
 	if (err)
@@ -298,7 +435,8 @@ struct dentry *trfs_lookup(struct inode *dir, struct dentry *dentry,
 
 	parent = dget_parent(dentry);
 
-	trfs_get_lower_path(parent, &lower_parent_path);
+	/* our reference on parent pins its lower path */
+	trfs_peek_lower_path(parent, &lower_parent_path);
 
 	/* allocate dentry private data.  We free it in ->d_release */
 	err = new_dentry_private_data(dentry);
@@ -319,7 +457,18 @@ struct dentry *trfs_lookup(struct inode *dir, struct dentry *dentry,
 				trfs_lower_inode(d_inode(parent)));
 
 out:
-	trfs_put_lower_path(parent, &lower_parent_path);
 	dput(parent);
+
+	/*
+	 * A negative lookup is recorded as -ENOENT, which is what replaying
+	 * it with a stat of the path returns.
+	 */
+	if (trfs_traced(TRFS_SB(dir->i_sb), dir, TRFS_TRACE_LOOKUP)) {
+		if (IS_ERR(ret))
+			err = PTR_ERR(ret);
+		else
+			err = d_inode(dentry) ? 0 : -ENOENT;
+		trfs_trace_path_op(TRFS_SB(dir->i_sb), 'k', dentry, err);
+	}
 	return ret;
 }
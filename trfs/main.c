@@ -24,26 +24,7 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	char *dev_name = NULL;
 	struct inode *inode;
 	struct trfs_path_info *tfile = (struct trfs_path_info *)raw_data;
-	struct file *fp = NULL;
-	char *buffer = NULL; /*buffer for tfile*/
-	buffer = kzalloc(4096,GFP_KERNEL);
-	if(IS_ERR(buffer)){
-		printk(KERN_ERR "Memory Allocation Error! ");
-		err = -EINVAL;
-		goto out;
-	}
-	
-
 
-	fp = filp_open(tfile->tfile_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-	if(IS_ERR(fp)){
-		printk(KERN_ERR "File Open Error! ");
-		err = (int) PTR_ERR(fp);
-		kfree(buffer);
-		goto out;
-	}
-	
-	
 	dev_name = tfile->dev_name;
 
 	//validation for tfile->tpath_info pending	
@@ -52,8 +33,6 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		printk(KERN_ERR
 		       "trfs: read_super: missing dev_name argument\n");
 		err = -EINVAL;
-		kfree(buffer);
-		filp_close(fp,NULL);
 		goto out;
 	}
 
@@ -63,8 +42,6 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	if (err) {
 		printk(KERN_ERR	"trfs: error accessing "
 		       "lower directory '%s'\n", dev_name);
-		kfree(buffer);
-                filp_close(fp,NULL);
 		goto out;
 	}
 
@@ -73,8 +50,6 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	if (!TRFS_SB(sb)) {
 		printk(KERN_CRIT "trfs: read_super: out of memory\n");
 		err = -ENOMEM;
-		kfree(buffer);
-                filp_close(fp,NULL);
 		goto out_free;
 	}
 
@@ -83,21 +58,24 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	atomic_inc(&lower_sb->s_active);
 	trfs_set_lower_super(sb, lower_sb);
 		
-	/*adding file path to struct trfs_sb_info, which is stored in private data of SB */
-	trfs_set_tfile(sb,fp);
+	/* open the tfile, or one tfile per cpu/node, and their buffers */
+	TRFS_SB(sb)->buf_size = tfile->buf_size;
+	TRFS_SB(sb)->mem_budget = tfile->mem_budget;
+	err = trfs_init_sinks(TRFS_SB(sb), tfile->tfile_path,
+			      tfile->sink_mode);
+	if (err)
+		goto out_sput;
+
+	/* trace memory accounting under /sys/fs/trfs */
+	err = trfs_sysfs_register(sb);
+	if (err)
+		goto out_sput;
 
-	//referencing allocated buffer to sb's private info struct->buffer
-	trfs_set_tbuffer(sb,buffer);
-	//storing a copy to the initial location of the buffer for kfreeing purpose
-	trfs_set_tbufferc(sb,buffer);
 	//setting the default value of the record id counter
 	trfs_set_record_id(sb,0);
 	
-	trfs_set_buffer_size(sb,0);
 	//setting the default bitmap value to sb' private info struct
 	trfs_set_bitmap(sb,0x7FFFFFFF);
-	//initializing the mutex lock saved in sb's private data
-	mutex_init(&TRFS_SB(sb)->buffer_lock);	
 	
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
@@ -116,15 +94,12 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	inode = trfs_iget(sb, d_inode(lower_path.dentry));
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
-		kfree(buffer);
-                filp_close(fp,NULL);
 		goto out_sput;
 	}
+	trfs_set_policy(inode, lower_path.dentry, NULL);
 	sb->s_root = d_make_root(inode);
 	if (!sb->s_root) {
 		err = -ENOMEM;
-		kfree(buffer);
-                filp_close(fp,NULL);
 		goto out_iput;
 	}
 	d_set_d_op(sb->s_root, &trfs_dops);
@@ -132,11 +107,8 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	/* link the upper and lower dentries */
 	sb->s_root->d_fsdata = NULL;
 	err = new_dentry_private_data(sb->s_root);
-	if (err){
-		kfree(buffer);
-                filp_close(fp,NULL);
+	if (err)
 		goto out_freeroot;
-	}
 
 	/* if get here: cannot have error */
 
@@ -163,6 +135,8 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+	trfs_sysfs_unregister(TRFS_SB(sb));
+	trfs_destroy_sinks(TRFS_SB(sb));
 	kfree(TRFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -174,6 +148,13 @@ out:
 	return err;
 }
 
+/*
+ * Mount options are comma separated:
+ *   tfile=/some/file	where records go (required, absolute path)
+ *   tsink=single|cpu|node	one tfile, or tfile.<n> per cpu or numa node
+ *   tbufsize=N[KM]	per-sink buffer, above 4K records are batched
+ *   tbudget=N[KM]	trace memory this mount may hold, default 16M
+ */
 struct dentry *trfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
@@ -181,56 +162,98 @@ struct dentry *trfs_mount(struct file_system_type *fs_type, int flags,
 	char *tfile_path = NULL;
 	struct trfs_path_info *tfile = NULL;
 	int err = 0;
-	char *mopt, *tpath;
+	int sink_mode = TRFS_SINK_SINGLE;
+	size_t buf_size = TRFS_MIN_BUF_SIZE;
+	long mem_budget = TRFS_DEFAULT_BUDGET;
+	char *options, *opt, *mopt;
 	
-	tpath = (char *)raw_data; //tpath ideally should contain "tfile=/temp/tfile.txt"
+	options = (char *)raw_data; //options ideally should contain "tfile=/temp/tfile.txt"
 	
-	if(IS_ERR(tpath)){
+	if(!options){
 		printk(KERN_ERR "Mount Option for tfile not passed\n");
 		err = -EINVAL;
 		goto out;
 	}
 	
-	/*tokenizing over "=" delimiter* using strsep*/
-	mopt = strsep(&tpath, "=");
-	
-	if (strcmp(mopt,"tfile")!=0){
-		printk(KERN_ERR "Mount option should be tfile=/some/file\n" );
-		err = -EINVAL;
-		goto out;
+	/*tokenizing over "," and then "=" delimiters using strsep*/
+	while ((opt = strsep(&options, ",")) != NULL) {
+		if (!*opt)
+			continue;
+		mopt = strsep(&opt, "=");
+		if (!opt || !*opt) {
+			printk(KERN_ERR "trfs: option %s needs a value\n", mopt);
+			err = -EINVAL;
+			goto out;
+		}
+		if (strcmp(mopt, "tfile") == 0) {
+			kfree(tfile_path);
+			tfile_path = kstrdup(opt, GFP_KERNEL);
+			if (!tfile_path) {
+				printk(KERN_ERR "Error Allocating Memory to tfile path buffer\n");
+				err = -ENOMEM;
+				goto out;
+			}
+		} else if (strcmp(mopt, "tsink") == 0) {
+			if (strcmp(opt, "single") == 0)
+				sink_mode = TRFS_SINK_SINGLE;
+			else if (strcmp(opt, "cpu") == 0)
+				sink_mode = TRFS_SINK_CPU;
+			else if (strcmp(opt, "node") == 0)
+				sink_mode = TRFS_SINK_NODE;
+			else {
+				printk(KERN_ERR "trfs: tsink should be single, cpu or node\n");
+				err = -EINVAL;
+				goto out;
+			}
+		} else if (strcmp(mopt, "tbufsize") == 0) {
+			buf_size = memparse(opt, NULL);
+			if (buf_size < TRFS_MIN_BUF_SIZE ||
+			    buf_size > TRFS_MAX_BUF_SIZE) {
+				printk(KERN_ERR "trfs: tbufsize should be 4K to 4M\n");
+				err = -EINVAL;
+				goto out;
+			}
+		} else if (strcmp(mopt, "tbudget") == 0) {
+			mem_budget = memparse(opt, NULL);
+			if (mem_budget < TRFS_MAX_RECORD) {
+				printk(KERN_ERR "trfs: tbudget should be at least 4K\n");
+				err = -EINVAL;
+				goto out;
+			}
+		} else {
+			printk(KERN_ERR "trfs: unknown mount option %s\n", mopt);
+			err = -EINVAL;
+			goto out;
+		}
 	}
-	//tpath should now point to /temp/tfile.txt
-	if(IS_ERR(tpath)){
-		printk(KERN_ERR "TFile path not entered!\n");
+
+	//tfile_path should now point to /temp/tfile.txt
+	if(!tfile_path){
+		printk(KERN_ERR "Mount option should be tfile=/some/file\n" );
 		err = -EINVAL;
 		goto out;
 	}
-	tfile_path = kzalloc(strlen(tpath),GFP_KERNEL);
-	if(IS_ERR(tfile_path)){
-		printk(KERN_ERR "Error Allocating Memory to tfile path buffer\n");
-		err = -ENOMEM;
-		goto out;
-	}
-	memcpy(tfile_path,tpath, strlen(tpath));
 	
 	tfile = kzalloc(sizeof(struct trfs_path_info), GFP_KERNEL);
 	
-	if(IS_ERR(tfile)){
+	if(!tfile){
 		printk(KERN_ERR " Error allocating memory to struct tfile_path_info\n");
-		kfree(tfile_path);
 		err= -ENOMEM;
 		goto out;
 	}
 	
 	tfile->dev_name = (char *)dev_name;
 	tfile->tfile_path = tfile_path;
+	tfile->sink_mode = sink_mode;
+	tfile->buf_size = buf_size;
+	tfile->mem_budget = mem_budget;
 	lower_path_name = (void *)tfile;
 	/*saving dev_name and tfile_path in a struct and passing its address to trfs_read_super*/
 	return mount_nodev(fs_type, flags, lower_path_name,
 			   trfs_read_super);
 
 out:
-	
+	kfree(tfile_path);
 	return ERR_PTR(err);
 }
 
@@ -253,6 +276,15 @@ static int __init init_trfs_fs(void)
 	if (err)
 		goto out;
 	err = trfs_init_dentry_cache();
+	if (err)
+		goto out;
+	err = trfs_init_file_cache();
+	if (err)
+		goto out;
+	err = trfs_init_trace_caches();
+	if (err)
+		goto out;
+	err = trfs_init_sysfs();
 	if (err)
 		goto out;
 	err = register_filesystem(&trfs_fs_type);
@@ -260,6 +292,9 @@ out:
 	if (err) {
 		trfs_destroy_inode_cache();
 		trfs_destroy_dentry_cache();
+		trfs_destroy_file_cache();
+		trfs_destroy_trace_caches();
+		trfs_exit_sysfs();
 	}
 	return err;
 }
@@ -268,6 +303,9 @@ static void __exit exit_trfs_fs(void)
 {
 	trfs_destroy_inode_cache();
 	trfs_destroy_dentry_cache();
+	trfs_destroy_file_cache();
+	trfs_destroy_trace_caches();
+	trfs_exit_sysfs();
 	unregister_filesystem(&trfs_fs_type);
 	pr_info("Completed trfs module unload\n");
 }
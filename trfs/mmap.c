@@ -11,83 +11,254 @@
 
 #include "trfs.h"
 
+/* the vm_ops the lower ->mmap set up, saved by trfs_mmap */
+static inline const struct vm_operations_struct *
+trfs_lower_vm_ops(struct vm_area_struct *vma)
+{
+	const struct vm_operations_struct *lower_vm_ops;
+
+	lower_vm_ops = TRFS_F(vma->vm_file)->lower_vm_ops;
+	BUG_ON(!lower_vm_ops);
+	return lower_vm_ops;
+}
+
+/*
+ * Set up @lower_vma for calling the lower vm_ops, which expect vm_file to
+ * be the lower file.  Callers check the lower op exists first, so there
+ * is no copy for nothing.
+ *
+ * XXX: vm_ops may be called in parallel.  Because we have to resort to
+ * temporarily changing the vma->vm_file to point to the lower file, a
+ * concurrent invocation of ours could see a different value.  In this
+ * workaround, we keep a different copy of the vma structure in our
+ * stack, so we never expose a different value of the vma->vm_file called
+ * to us, even temporarily.  A better fix would be to change the calling
+ * semantics of vm_ops to take an explicit file pointer.
+ */
+static inline void trfs_lower_vma(struct vm_area_struct *vma,
+				  struct vm_area_struct *lower_vma)
+{
+	memcpy(lower_vma, vma, sizeof(struct vm_area_struct));
+	lower_vma->vm_file = trfs_lower_file(vma->vm_file);
+}
+
+/*
+ * Faults are traced 1 in fault_sample as 'M' records: the open record id,
+ * the file offset of the page, 'r' or 'w' for a read or write fault and
+ * 'k' for page_mkwrite, whether it was major (the page had to be read),
+ * the latency in ns and the VM_FAULT_* result.
+ *
+ * With VM_FAULT_RETRY the lower fault has dropped mmap_sem and the vma
+ * may be gone, so all the record needs is taken from it up front.  The
+ * record is deferred (trfs_record_begin_deferred): mmap_sem is held, and
+ * after page_mkwrite maybe the page lock too.
+ */
+struct trfs_fault_trace {
+	struct trfs_sb_info *sbi;
+	int open_record_id;
+	u64 start;
+};
+
+static bool trfs_fault_sampled(struct vm_area_struct *vma,
+			       struct trfs_fault_trace *ft)
+{
+	struct file *file = vma->vm_file;
+
+	ft->sbi = TRFS_SB(file_inode(file)->i_sb);
+	if (!trfs_traced(ft->sbi, file_inode(file), TRFS_TRACE_FAULT) ||
+	    !trfs_sample(ft->sbi->fault_count,
+			 READ_ONCE(ft->sbi->fault_sample)))
+		return false;
+	ft->open_record_id = TRFS_F(file)->record_id;
+	ft->start = ktime_get_ns();
+	return true;
+}
+
+static void trfs_trace_fault(struct trfs_fault_trace *ft, char kind,
+			     pgoff_t pgoff, int ret)
+{
+	struct trfs_record rec;
+	u64 latency = ktime_get_ns() - ft->start;
+	s64 offset = (s64)pgoff << PAGE_SHIFT;
+	char major = !!(ret & VM_FAULT_MAJOR);
+	u32 result = ret;
+
+	if (trfs_record_begin_deferred(ft->sbi, &rec, 'M',
+				       TRFS_REC_HDR_SIZE +
+				       sizeof(ft->open_record_id) +
+				       sizeof(offset) + sizeof(kind) +
+				       sizeof(major) + sizeof(latency) +
+				       sizeof(result)))
+		return;
+	trfs_record_put(&rec, &ft->open_record_id,
+			sizeof(ft->open_record_id));
+	trfs_record_put(&rec, &offset, sizeof(offset));
+	trfs_record_put(&rec, &kind, sizeof(kind));
+	trfs_record_put(&rec, &major, sizeof(major));
+	trfs_record_put(&rec, &latency, sizeof(latency));
+	trfs_record_put(&rec, &result, sizeof(result));
+	trfs_record_end(&rec);
+}
+
 static int trfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int err;
-	struct file *file, *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct vm_area_struct lower_vma;
+	struct trfs_fault_trace ft;
+	bool sampled;
+	int ret;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
-	lower_vm_ops = TRFS_F(file)->lower_vm_ops;
-	BUG_ON(!lower_vm_ops);
+	lower_vm_ops = trfs_lower_vm_ops(vma);
+	trfs_lower_vma(vma, &lower_vma);
+	sampled = trfs_fault_sampled(vma, &ft);
+	ret = lower_vm_ops->fault(&lower_vma, vmf);
+	if (sampled)
+		trfs_trace_fault(&ft, vmf->flags & FAULT_FLAG_WRITE ? 'w' : 'r',
+				 vmf->pgoff, ret);
+	return ret;
+}
 
-	lower_file = trfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->fault may be called in parallel.  Because we have to
-	 * resort to temporarily changing the vma->vm_file to point to the
-	 * lower file, a concurrent invocation of trfs_fault could see a
-	 * different value.  In this workaround, we keep a different copy of
-	 * the vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.  A
-	 * better fix would be to change the calling semantics of ->fault to
-	 * take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->fault(&lower_vma, vmf);
-	return err;
+/*
+ * Fault-around: map the pages around a read fault that are already in
+ * the lower page cache, so sequential readers of a mapping take one
+ * fault per fault_around_bytes instead of one per page, and the vma is
+ * copied once per batch.
+ */
+static void trfs_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct lower_vma;
+
+	lower_vm_ops = trfs_lower_vm_ops(vma);
+	if (!lower_vm_ops->map_pages)
+		return;
+	trfs_lower_vma(vma, &lower_vma);
+	lower_vm_ops->map_pages(&lower_vma, vmf);
+}
+
+/* huge pages, from a lower fs that maps them (DAX) */
+static int trfs_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+			  pmd_t *pmd, unsigned int flags)
+{
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct lower_vma;
+
+	lower_vm_ops = trfs_lower_vm_ops(vma);
+	if (!lower_vm_ops->pmd_fault)
+		return VM_FAULT_FALLBACK;
+	trfs_lower_vma(vma, &lower_vma);
+	return lower_vm_ops->pmd_fault(&lower_vma, address, pmd, flags);
 }
 
 static int trfs_page_mkwrite(struct vm_area_struct *vma,
 			       struct vm_fault *vmf)
 {
-	int err = 0;
-	struct file *file, *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	struct vm_area_struct lower_vma;
+	struct trfs_fault_trace ft;
+	bool sampled;
+	int ret;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
-	lower_vm_ops = TRFS_F(file)->lower_vm_ops;
-	BUG_ON(!lower_vm_ops);
+	lower_vm_ops = trfs_lower_vm_ops(vma);
 	if (!lower_vm_ops->page_mkwrite)
-		goto out;
-
-	lower_file = trfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->page_mkwrite may be called in parallel.
-	 * Because we have to resort to temporarily changing the
-	 * vma->vm_file to point to the lower file, a concurrent
-	 * invocation of trfs_page_mkwrite could see a different
-	 * value.  In this workaround, we keep a different copy of the
-	 * vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.
-	 * A better fix would be to change the calling semantics of
-	 * ->page_mkwrite to take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->page_mkwrite(&lower_vma, vmf);
-out:
-	return err;
+		return 0;
+	trfs_lower_vma(vma, &lower_vma);
+	sampled = trfs_fault_sampled(vma, &ft);
+	ret = lower_vm_ops->page_mkwrite(&lower_vma, vmf);
+	if (sampled)
+		trfs_trace_fault(&ft, 'k', vmf->pgoff, ret);
+	return ret;
 }
 
+/*
+ * Besides getting O_DIRECT opens past open_check_o_direct(), this is
+ * reached by generic code doing direct I/O on our mapping.  Hand the
+ * iocb (IOCB_DIRECT, @pos is iocb->ki_pos) to the lower file, which does
+ * the direct I/O and enforces its own alignment.
+ */
 static ssize_t trfs_direct_IO(struct kiocb *iocb,
 				struct iov_iter *iter, loff_t pos)
 {
+	if (iov_iter_rw(iter) == WRITE)
+		return trfs_write_iter(iocb, iter);
+	return trfs_read_iter(iocb, iter);
+}
+
+/*
+ * An 'h' record: a readahead window issued on the lower file for an open
+ * file.  It is not a syscall: fadvise, readahead(2) and madvise all end
+ * up here and look alike, and the readahead itself has no result.
+ * madvise holds mmap_sem, so like faults the record is deferred.
+ */
+static void trfs_trace_hint(struct file *file, s64 offset, s64 len)
+{
+	struct trfs_sb_info *sb_info = TRFS_SB(file->f_inode->i_sb);
+	struct trfs_record rec;
+	int open_record_id = TRFS_F(file)->record_id;
+
+	if (!trfs_traced(sb_info, file_inode(file), TRFS_TRACE_FADVISE) ||
+	    trfs_record_begin_deferred(sb_info, &rec, 'h', TRFS_REC_HDR_SIZE +
+				       sizeof(open_record_id) + sizeof(offset) +
+				       sizeof(len)))
+		return;
+	trfs_record_put(&rec, &open_record_id, sizeof(open_record_id));
+	trfs_record_put(&rec, &offset, sizeof(offset));
+	trfs_record_put(&rec, &len, sizeof(len));
+	trfs_record_end(&rec);
+}
+
+/*
+ * Readahead hints on a trfs file (fadvise WILLNEED, readahead(2), madvise
+ * WILLNEED) read ahead into our mapping, which nothing ever reads: the
+ * data is cached in the lower file's mapping.  So read the range of
+ * @pages ahead in the lower file instead, and leave @pages to be dropped
+ * by read_pages().  Without this the hints failed with -EINVAL.
+ */
+static int trfs_readpages(struct file *file, struct address_space *mapping,
+			  struct list_head *pages, unsigned nr_pages)
+{
+	struct file *lower_file;
+	const struct address_space_operations *lower_aops;
+	struct file_ra_state ra;
+	struct page *page;
+	pgoff_t start = ULONG_MAX, end = 0;
+	unsigned long nr;
+
+	if (!file)
+		return 0;
+	lower_file = trfs_lower_file(file);
+	lower_aops = lower_file->f_mapping->a_ops;
+	if (!lower_aops->readpage && !lower_aops->readpages)
+		return 0;
+	list_for_each_entry(page, pages, lru) {
+		start = min(start, page->index);
+		end = max(end, page->index);
+	}
+	if (start > end)
+		return 0;
+	nr = end - start + 1;
+
 	/*
-	 * This function should never be called directly.  We need it
-	 * to exist, to get past a check in open_check_o_direct(),
-	 * which is called from do_last().
+	 * A window of our own, as large as the request, so the hint is read
+	 * in full and the lower file's readahead state is left alone.
 	 */
-	return -EINVAL;
+	file_ra_state_init(&ra, lower_file->f_mapping);
+	ra.ra_pages = max_t(unsigned long, ra.ra_pages, nr);
+	page_cache_sync_readahead(lower_file->f_mapping, &ra, lower_file,
+				  start, nr);
+
+	trfs_trace_hint(file, (s64)start << PAGE_SHIFT, (s64)nr << PAGE_SHIFT);
+	return 0;
 }
 
 const struct address_space_operations trfs_aops = {
+	.readpages = trfs_readpages,
 	.direct_IO = trfs_direct_IO,
 };
 
 const struct vm_operations_struct trfs_vm_ops = {
 	.fault		= trfs_fault,
+	.map_pages	= trfs_map_pages,
+	.pmd_fault	= trfs_pmd_fault,
 	.page_mkwrite	= trfs_page_mkwrite,
 };
@@ -27,10 +27,9 @@ static void trfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
-	if(spd->tf)
-		filp_close(spd->tf,NULL);
-	if(spd->bufferc)
-		kfree(spd->bufferc);
+	/* flush and close every tfile stream and free its buffer */
+	trfs_sysfs_unregister(spd);
+	trfs_destroy_sinks(spd);
 
 	/* decrement lower super references */
 	s = trfs_lower_super(sb);
@@ -46,9 +45,8 @@ static int trfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	int err;
 	struct path lower_path;
 
-	trfs_get_lower_path(dentry, &lower_path);
+	trfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_statfs(&lower_path, buf);
-	trfs_put_lower_path(dentry, &lower_path);
 
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = TRFS_SUPER_MAGIC;
@@ -109,16 +107,27 @@ static struct inode *trfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct trfs_inode_info, vfs_inode));
+	/* no policy of its own, and stale until trfs_set_policy() */
+	i->own_policy = TRFS_POLICY_NONE;
+	i->policy_gen = atomic_read(&TRFS_SB(sb)->policy_gen) - 1;
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
 }
 
-static void trfs_destroy_inode(struct inode *inode)
+static void trfs_i_callback(struct rcu_head *head)
 {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
 	kmem_cache_free(trfs_inode_cachep, TRFS_I(inode));
 }
 
+/* RCU-walk may still be looking at the inode, free it after a grace period */
+static void trfs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, trfs_i_callback);
+}
+
 /* trfs inode cache constructor */
 static void init_once(void *obj)
 {
@@ -143,10 +152,42 @@ int trfs_init_inode_cache(void)
 /* trfs inode cache destructor */
 void trfs_destroy_inode_cache(void)
 {
+	/* wait for the inodes still queued by trfs_destroy_inode */
+	rcu_barrier();
 	if (trfs_inode_cachep)
 		kmem_cache_destroy(trfs_inode_cachep);
 }
 
+/*
+ * sync(2), syncfs(2) and umount: the first, non-waiting pass only writes
+ * out buffered records, the waiting one syncs the lower fs and makes the
+ * records durable behind a sync checkpoint (trfs_checkpoint).
+ */
+static int trfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct trfs_sb_info *sbi = TRFS_SB(sb);
+
+	if (!sbi)
+		return 0;
+	if (!wait)
+		return trfs_flush_sinks(sbi, false);
+	return trfs_checkpoint(sbi, 's');
+}
+
+/*
+ * Freezing for a snapshot: writes are already blocked and synced, so the
+ * freeze checkpoint marks where the snapshot stands in the trace.
+ */
+static int trfs_freeze_fs(struct super_block *sb)
+{
+	return trfs_checkpoint(TRFS_SB(sb), 'f');
+}
+
+static int trfs_unfreeze_fs(struct super_block *sb)
+{
+	return trfs_checkpoint(TRFS_SB(sb), 'u');
+}
+
 /*
  * Used only in nfs, to kill any pending RPC tasks, so that subsequent
  * code can actually succeed and won't leave tasks that need handling.
@@ -163,6 +204,9 @@ static void trfs_umount_begin(struct super_block *sb)
 const struct super_operations trfs_sops = {
 	.put_super	= trfs_put_super,
 	.statfs		= trfs_statfs,
+	.sync_fs	= trfs_sync_fs,
+	.freeze_fs	= trfs_freeze_fs,
+	.unfreeze_fs	= trfs_unfreeze_fs,
 	.remount_fs	= trfs_remount_fs,
 	.evict_inode	= trfs_evict_inode,
 	.umount_begin	= trfs_umount_begin,
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 1998-2015 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2015 Stony Brook University
+ * Copyright (c) 2003-2015 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "trfs.h"
+
+/*
+ * Every mount gets /sys/fs/trfs/<major:minor>/ (the anonymous device
+ * number shown by stat -c %d on the mount point) exposing how much trace
+ * memory it holds against its budget.
+ */
+static struct kset *trfs_kset;
+
+struct trfs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct trfs_sb_info *sbi, char *buf);
+	ssize_t (*store)(struct trfs_sb_info *sbi, const char *buf,
+			 size_t len);
+};
+
+static ssize_t mem_used_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%ld\n",
+			atomic_long_read(&sbi->mem_used));
+}
+
+static ssize_t mem_budget_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%ld\n", sbi->mem_budget);
+}
+
+/* a lower budget takes effect as idle buffers are shrunk */
+static ssize_t mem_budget_store(struct trfs_sb_info *sbi, const char *buf,
+				size_t len)
+{
+	long budget;
+	int err;
+
+	err = kstrtol(buf, 0, &budget);
+	if (err)
+		return err;
+	if (budget < TRFS_MAX_RECORD)
+		return -EINVAL;
+	sbi->mem_budget = budget;
+	return len;
+}
+
+static ssize_t buf_size_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%zu\n", sbi->buf_size);
+}
+
+static ssize_t sinks_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", sbi->nr_sinks);
+}
+
+static ssize_t shrunk_pages_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%ld\n",
+			atomic_long_read(&sbi->nr_shrunk));
+}
+
+static ssize_t dropped_show(struct trfs_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%ld\n",
+			atomic_long_read(&sbi->nr_dropped));
+}
+
+#define TRFS_ATTR_RO(_name) \
+	static struct trfs_attr trfs_attr_##_name = __ATTR_RO(_name)
+#define TRFS_ATTR_RW(_name) \
+	static struct trfs_attr trfs_attr_##_name = \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+
+TRFS_ATTR_RO(mem_used);
+TRFS_ATTR_RW(mem_budget);
+TRFS_ATTR_RO(buf_size);
+TRFS_ATTR_RO(sinks);
+TRFS_ATTR_RO(shrunk_pages);
+TRFS_ATTR_RO(dropped);
+
+static struct attribute *trfs_attrs[] = {
+	&trfs_attr_mem_used.attr,
+	&trfs_attr_mem_budget.attr,
+	&trfs_attr_buf_size.attr,
+	&trfs_attr_sinks.attr,
+	&trfs_attr_shrunk_pages.attr,
+	&trfs_attr_dropped.attr,
+	NULL,
+};
+
+static ssize_t trfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	struct trfs_sb_info *sbi =
+		container_of(kobj, struct trfs_sb_info, kobj);
+	struct trfs_attr *a = container_of(attr, struct trfs_attr, attr);
+
+	return a->show ? a->show(sbi, buf) : 0;
+}
+
+static ssize_t trfs_attr_store(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct trfs_sb_info *sbi =
+		container_of(kobj, struct trfs_sb_info, kobj);
+	struct trfs_attr *a = container_of(attr, struct trfs_attr, attr);
+
+	return a->store ? a->store(sbi, buf, len) : -EIO;
+}
+
+static const struct sysfs_ops trfs_attr_ops = {
+	.show	= trfs_attr_show,
+	.store	= trfs_attr_store,
+};
+
+static void trfs_sb_release(struct kobject *kobj)
+{
+	struct trfs_sb_info *sbi =
+		container_of(kobj, struct trfs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type trfs_sb_ktype = {
+	.default_attrs	= trfs_attrs,
+	.sysfs_ops	= &trfs_attr_ops,
+	.release	= trfs_sb_release,
+};
+
+int trfs_sysfs_register(struct super_block *sb)
+{
+	struct trfs_sb_info *sbi = TRFS_SB(sb);
+	int err;
+
+	sbi->kobj.kset = trfs_kset;
+	init_completion(&sbi->kobj_unregister);
+	err = kobject_init_and_add(&sbi->kobj, &trfs_sb_ktype, NULL, "%u:%u",
+				   MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	if (err) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		sbi->kobj.state_initialized = 0;
+	}
+	return err;
+}
+
+/* safe to call whether or not trfs_sysfs_register succeeded */
+void trfs_sysfs_unregister(struct trfs_sb_info *sbi)
+{
+	if (!sbi->kobj.state_initialized)
+		return;
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+int trfs_init_sysfs(void)
+{
+	trfs_kset = kset_create_and_add(TRFS_NAME, NULL, fs_kobj);
+	return trfs_kset ? 0 : -ENOMEM;
+}
+
+void trfs_exit_sysfs(void)
+{
+	if (trfs_kset)
+		kset_unregister(trfs_kset);
+	trfs_kset = NULL;
+}
@@ -0,0 +1,813 @@
+/*
+ * Copyright (c) 1998-2015 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2015 Stony Brook University
+ * Copyright (c) 2003-2015 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "trfs.h"
+#include <linux/mempool.h>
+#include <linux/crc32.h>
+#include <linux/jhash.h>
+#include <linux/pid_namespace.h>
+
+/* staging buffers reserved so records never get lost to a failed alloc */
+#define TRFS_STAGING_RESERVE	16
+
+/*
+ * Per-op scratch space (paths from dentry_path_raw, payload copied from
+ * user space) comes from a dedicated cache backed by a mempool, so the
+ * allocation on the I/O path is constant-time and, as long as we may
+ * sleep, cannot fail under memory pressure.
+ */
+static struct kmem_cache *trfs_staging_cachep;
+static mempool_t *trfs_staging_pool;
+
+/*
+ * Digest windows, see trfs_payload(): a second pool of the same buffers,
+ * so a task holding a staging buffer can always get a window as well.
+ */
+static mempool_t *trfs_window_pool;
+
+int trfs_init_trace_caches(void)
+{
+	trfs_staging_cachep =
+		kmem_cache_create("trfs_staging", TRFS_MAX_RECORD, 0,
+				  SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!trfs_staging_cachep)
+		return -ENOMEM;
+
+	trfs_staging_pool = mempool_create_slab_pool(TRFS_STAGING_RESERVE,
+						     trfs_staging_cachep);
+	trfs_window_pool = mempool_create_slab_pool(TRFS_STAGING_RESERVE,
+						    trfs_staging_cachep);
+	if (!trfs_staging_pool || !trfs_window_pool) {
+		trfs_destroy_trace_caches();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void trfs_destroy_trace_caches(void)
+{
+	if (trfs_window_pool)
+		mempool_destroy(trfs_window_pool);
+	if (trfs_staging_pool)
+		mempool_destroy(trfs_staging_pool);
+	if (trfs_staging_cachep)
+		kmem_cache_destroy(trfs_staging_cachep);
+	trfs_window_pool = NULL;
+	trfs_staging_pool = NULL;
+	trfs_staging_cachep = NULL;
+}
+
+/*
+ * Get a TRFS_MAX_RECORD sized staging buffer.  Never take two at once
+ * from one thread: a mempool can deadlock if its reserve is held by
+ * callers waiting for a second element.
+ */
+char *trfs_staging_alloc(void)
+{
+	return mempool_alloc(trfs_staging_pool, GFP_NOFS);
+}
+
+void trfs_staging_free(char *buf)
+{
+	if (buf)
+		mempool_free(buf, trfs_staging_pool);
+}
+
+/* a TRFS_MAX_RECORD sized digest window, one at a time like staging */
+char *trfs_window_alloc(void)
+{
+	return mempool_alloc(trfs_window_pool, GFP_NOFS);
+}
+
+void trfs_window_free(char *buf)
+{
+	if (buf)
+		mempool_free(buf, trfs_window_pool);
+}
+
+static int write_file(struct file *file,char *buff, int len){
+	int ret;
+	mm_segment_t fs;
+	fs = get_fs();
+	set_fs(get_ds());
+
+	ret = vfs_write(file,buff,len,&file->f_pos);
+
+	set_fs(fs);
+	return ret;
+}
+
+/*
+ * Pick the sink for the calling context.  In per-cpu and per-node mode
+ * each sink has its own tfile and lock, so writers on different cpus
+ * never serialize on one inode.  We may migrate after picking, which is
+ * harmless: the sink mutex still protects the stream.
+ */
+static struct trfs_sink *trfs_pick_sink(struct trfs_sb_info *sbi)
+{
+	switch (sbi->sink_mode) {
+	case TRFS_SINK_CPU:
+		return &sbi->sinks[raw_smp_processor_id()];
+	case TRFS_SINK_NODE:
+		return &sbi->sinks[cpu_to_node(raw_smp_processor_id())];
+	}
+	return &sbi->sinks[0];
+}
+
+/*
+ * Path of @dentry relative to the trfs root, without the leading '/',
+ * as treplay wants it.  Returns NULL for the root itself or if the path
+ * doesn't fit in @buf.
+ */
+char *trfs_record_path(struct dentry *dentry, char *buf, int buflen)
+{
+	char *path;
+
+	if (!buf)
+		return NULL;
+	path = dentry_path_raw(dentry, buf, buflen);
+	if (IS_ERR(path) || strlen(path) <= 1)
+		return NULL;
+	return path + 1;
+}
+
+/* trace an op whose record is just the path of @dentry and its result */
+void trfs_trace_path_op(struct trfs_sb_info *sbi, char type,
+			struct dentry *dentry, int err)
+{
+	struct trfs_record rec;
+	char *buffer, *path;
+
+	buffer = trfs_staging_alloc();
+	path = trfs_record_path(dentry, buffer, TRFS_MAX_RECORD);
+	if (path && !trfs_record_begin(sbi, &rec, type,
+			TRFS_REC_HDR_SIZE + trfs_path_size(path) +
+			sizeof(err))) {
+		trfs_record_put_path(&rec, path);
+		trfs_record_put(&rec, &err, sizeof(err));
+		trfs_record_end(&rec);
+	}
+	trfs_staging_free(buffer);
+}
+
+/* write out whatever the sink has buffered, called with sink->lock held */
+static void trfs_sink_flush(struct trfs_sink *sink)
+{
+	if (sink->len)
+		write_file(sink->tf, sink->buffer, sink->len);
+	sink->len = 0;
+}
+
+/*
+ * Give a sink its buffer, charged to the mount's budget.  When the budget
+ * is used up or the allocation fails the sink stays without a buffer and
+ * its records go through the mount's reserve buffer, written one by one.
+ */
+static void trfs_sink_alloc(struct trfs_sb_info *sbi, struct trfs_sink *sink)
+{
+	size_t size = sbi->buf_size;
+
+	if (atomic_long_add_return(size, &sbi->mem_used) > sbi->mem_budget)
+		goto out_uncharge;
+	sink->buffer = kmalloc(size, GFP_NOFS | __GFP_NORETRY | __GFP_NOWARN);
+	if (!sink->buffer)
+		goto out_uncharge;
+	sink->size = size;
+	sink->len = 0;
+	return;
+
+out_uncharge:
+	atomic_long_sub(size, &sbi->mem_used);
+}
+
+/* flush and free a sink's buffer, called with sink->lock held */
+static void trfs_sink_free(struct trfs_sb_info *sbi, struct trfs_sink *sink)
+{
+	if (!sink->buffer)
+		return;
+	trfs_sink_flush(sink);
+	kfree(sink->buffer);
+	sink->buffer = NULL;
+	atomic_long_sub(sink->size, &sbi->mem_used);
+	sink->size = 0;
+}
+
+/* true if the task of an interned context is still running */
+static bool trfs_ctx_alive(struct trfs_ctx_entry *e)
+{
+	struct task_struct *task;
+	bool alive;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(e->pid, &init_pid_ns), PIDTYPE_PID);
+	alive = task && task->start_time == e->start_time;
+	rcu_read_unlock();
+	return alive;
+}
+
+/*
+ * Drop the entries of exited tasks, called with ctx_lock held.  The next
+ * prune waits until the table has doubled, so a table of live tasks
+ * isn't walked on every new task.
+ */
+static void trfs_ctx_prune(struct trfs_sb_info *sbi)
+{
+	struct trfs_ctx_entry *e;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < 1 << TRFS_CTX_BITS; i++) {
+		hlist_for_each_entry_safe(e, tmp, &sbi->ctx_hash[i], node) {
+			if (trfs_ctx_alive(e))
+				continue;
+			hlist_del_rcu(&e->node);
+			kfree_rcu(e, rcu);
+			sbi->nr_ctx--;
+		}
+	}
+	sbi->ctx_prune_at = max_t(unsigned int, TRFS_CTX_PRUNE,
+				  2 * sbi->nr_ctx);
+}
+
+/*
+ * Context id of the current task.  *@new is set when the task wasn't in
+ * the table, and its id still has to be defined in the trace.  Only the
+ * task itself adds its entry, so the lookup needs no lock and no two
+ * entries are ever added for one task.  Without memory for an entry the
+ * record goes under context 0, unknown.
+ */
+static u32 trfs_task_ctx(struct trfs_sb_info *sbi, bool *new)
+{
+	struct hlist_head *head;
+	struct trfs_ctx_entry *e;
+	pid_t pid = task_pid_nr(current);
+	u64 start_time = current->start_time;
+	u32 id;
+
+	*new = false;
+	head = &sbi->ctx_hash[hash_32(pid, TRFS_CTX_BITS)];
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, head, node) {
+		if (e->pid == pid && e->start_time == start_time) {
+			id = e->id;
+			rcu_read_unlock();
+			return id;
+		}
+	}
+	rcu_read_unlock();
+
+	e = kmalloc(sizeof(*e), GFP_NOFS);
+	if (!e)
+		return 0;
+	e->pid = pid;
+	e->start_time = start_time;
+	spin_lock(&sbi->ctx_lock);
+	if (sbi->nr_ctx >= sbi->ctx_prune_at)
+		trfs_ctx_prune(sbi);
+	id = e->id = ++sbi->last_ctx;
+	hlist_add_head_rcu(&e->node, head);
+	sbi->nr_ctx++;
+	spin_unlock(&sbi->ctx_lock);
+	*new = true;
+	return id;
+}
+
+/* free the context table, no records are being written any more */
+static void trfs_free_ctx(struct trfs_sb_info *sbi)
+{
+	struct trfs_ctx_entry *e;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; sbi->ctx_hash && i < 1 << TRFS_CTX_BITS; i++) {
+		hlist_for_each_entry_safe(e, tmp, &sbi->ctx_hash[i], node)
+			kfree(e);
+	}
+	kfree(sbi->ctx_hash);
+	sbi->ctx_hash = NULL;
+	sbi->nr_ctx = 0;
+}
+
+/* id of the current task's cgroup on the default hierarchy */
+static u64 trfs_task_cgroup_id(void)
+{
+	u64 id = 0;
+
+#ifdef CONFIG_CGROUPS
+	rcu_read_lock();
+	id = task_dfl_cgroup(current)->kn->ino;
+	rcu_read_unlock();
+#endif
+	return id;
+}
+
+/*
+ * Place @rec at the end of the locked @sink and write its header.  The
+ * record id is taken under the sink lock, so ids are increasing within
+ * every tfile and readers can merge the per-cpu streams on record id.
+ */
+static void trfs_record_start(struct trfs_sb_info *sbi,
+			      struct trfs_sink *sink, struct trfs_record *rec,
+			      char type, size_t size, u32 ctx)
+{
+	u16 rec_size = size;
+
+	if (!sink->buffer)
+		trfs_sink_alloc(sbi, sink);
+	if (sink->buffer && sink->len + size > sink->size)
+		trfs_sink_flush(sink);
+
+	rec->sbi = sbi;
+	rec->sink = sink;
+	if (sink->buffer) {
+		rec->start = sink->buffer + sink->len;
+	} else {
+		/* lock order: sink->lock, then reserve_lock */
+		mutex_lock(&sbi->reserve_lock);
+		rec->start = sbi->reserve;
+	}
+	rec->pos = rec->start;
+	rec->id = atomic_inc_return(&sbi->record_id) - 1;
+
+	trfs_record_put(rec, &rec_size, sizeof(rec_size));
+	trfs_record_put(rec, &rec->id, sizeof(rec->id));
+	trfs_record_put(rec, &ctx, sizeof(ctx));
+	trfs_record_put(rec, &type, sizeof(type));
+}
+
+/*
+ * Finish a record, the sink stays locked.  The size given when it was
+ * begun is only the room reserved: the header gets what was actually put.
+ * Sinks with a one-record buffer write every record straight through;
+ * bigger buffers batch records and are written when full, under memory
+ * pressure or at unmount.
+ */
+static void trfs_record_commit(struct trfs_record *rec)
+{
+	struct trfs_sink *sink = rec->sink;
+	u16 rec_size = rec->pos - rec->start;
+
+	memcpy(rec->start, &rec_size, sizeof(rec_size));
+
+	if (rec->start == rec->sbi->reserve) {
+		write_file(sink->tf, rec->start, rec->pos - rec->start);
+		mutex_unlock(&rec->sbi->reserve_lock);
+	} else {
+		sink->len += rec->pos - rec->start;
+		if (sink->size > TRFS_MAX_RECORD)
+			return;
+		if (rec->deferred)
+			schedule_work(&rec->sbi->flush_work);
+		else
+			trfs_sink_flush(sink);
+	}
+}
+
+/* most room a 'D' record takes */
+#define TRFS_DEFINE_CTX_SIZE	(TRFS_REC_HDR_SIZE + 2 * sizeof(s32) + \
+				 sizeof(u32) + sizeof(u64) + TASK_COMM_LEN)
+
+/* 'D' record defining context @ctx as the current task */
+static void trfs_define_ctx(struct trfs_sb_info *sbi,
+			    struct trfs_sink *sink, u32 ctx, bool deferred)
+{
+	struct trfs_record rec;
+	s32 pid = task_pid_nr(current);
+	s32 tgid = task_tgid_nr(current);
+	u32 uid = from_kuid_munged(&init_user_ns, current_uid());
+	u64 cgroup = trfs_task_cgroup_id();
+	char comm[TASK_COMM_LEN];
+
+	get_task_comm(comm, current);
+	rec.deferred = deferred;
+	trfs_record_start(sbi, sink, &rec, 'D', TRFS_REC_HDR_SIZE +
+			  sizeof(pid) + sizeof(tgid) + sizeof(uid) +
+			  sizeof(cgroup) + sizeof(comm), ctx);
+	trfs_record_put(&rec, &pid, sizeof(pid));
+	trfs_record_put(&rec, &tgid, sizeof(tgid));
+	trfs_record_put(&rec, &uid, sizeof(uid));
+	trfs_record_put(&rec, &cgroup, sizeof(cgroup));
+	trfs_record_put(&rec, comm, sizeof(comm));
+	trfs_record_commit(&rec);
+}
+
+/*
+ * Start a record of @size bytes (header included) of type @type, for
+ * the current task.  A task seen for the first time gets its context
+ * defined just before, in the same sink.
+ *
+ * Returns 0 with the sink locked, or -E2BIG if the record can't fit.
+ */
+int trfs_record_begin(struct trfs_sb_info *sbi, struct trfs_record *rec,
+		      char type, size_t size)
+{
+	struct trfs_sink *sink;
+	bool new_ctx;
+	u32 ctx;
+
+	if (size < TRFS_REC_HDR_SIZE || size >= TRFS_MAX_RECORD)
+		return -E2BIG;
+
+	ctx = trfs_task_ctx(sbi, &new_ctx);
+	sink = trfs_pick_sink(sbi);
+	mutex_lock(&sink->lock);
+	sink->active = true;
+	if (new_ctx)
+		trfs_define_ctx(sbi, sink, ctx, false);
+	rec->deferred = false;
+	trfs_record_start(sbi, sink, rec, type, size, ctx);
+	return 0;
+}
+
+/*
+ * trfs_record_begin() for faults and readahead, which run with mmap_sem
+ * held and maybe a page locked: nothing may wait on a tfile write there,
+ * or a slow or frozen tfile fs would stall the whole mm.  So the sink is
+ * only tried, the record only goes into its buffer, room for a context
+ * definition included, and sbi->flush_work writes the buffer out.  If
+ * the sink is busy or its buffer has no room, the record is dropped and
+ * counted in sbi->nr_dropped.
+ *
+ * Returns 0 with the sink locked, -E2BIG or -EBUSY.
+ */
+int trfs_record_begin_deferred(struct trfs_sb_info *sbi,
+			       struct trfs_record *rec, char type,
+			       size_t size)
+{
+	struct trfs_sink *sink;
+	bool new_ctx;
+	u32 ctx;
+
+	if (size < TRFS_REC_HDR_SIZE || size >= TRFS_MAX_RECORD)
+		return -E2BIG;
+
+	sink = trfs_pick_sink(sbi);
+	if (!mutex_trylock(&sink->lock))
+		goto out_drop;
+	if (!sink->buffer)
+		trfs_sink_alloc(sbi, sink);
+	if (!sink->buffer ||
+	    sink->len + TRFS_DEFINE_CTX_SIZE + size > sink->size) {
+		mutex_unlock(&sink->lock);
+		goto out_drop;
+	}
+	sink->active = true;
+	ctx = trfs_task_ctx(sbi, &new_ctx);
+	if (new_ctx)
+		trfs_define_ctx(sbi, sink, ctx, true);
+	rec->deferred = true;
+	trfs_record_start(sbi, sink, rec, type, size, ctx);
+	return 0;
+
+out_drop:
+	atomic_long_inc(&sbi->nr_dropped);
+	return -EBUSY;
+}
+
+/* 64 bits of two independent hashes, a false match is what would hurt */
+static u64 trfs_chunk_hash(const char *data, u32 len)
+{
+	return (u64)jhash(data, len, 0) << 32 | crc32_le(~0, data, len);
+}
+
+/* most chunks a record can hold */
+#define TRFS_MAX_CHUNKS		(TRFS_MAX_RECORD / TRFS_DEDUP_CHUNK)
+
+/*
+ * Put @len bytes of write data into @rec as TRFS_DEDUP_CHUNK byte chunks.
+ * A full chunk that went into one of the last TRFS_DEDUP_WINDOW records,
+ * or earlier into this one, is put as a reference to it instead, so
+ * readers only have to keep that many records around.  Recent chunks are
+ * remembered in a direct-mapped table, each hit moving the chunk forward
+ * to the current record.  The chunks are hashed first and looked up in
+ * one go, so the table lock is taken once per record.
+ *
+ * The record has to be begun with room for every chunk as data; it ends
+ * up shorter when references were put.
+ */
+void trfs_record_put_chunks(struct trfs_record *rec, const char *data,
+			    u32 len)
+{
+	struct trfs_sb_info *sbi = rec->sbi;
+	struct trfs_dedup_slot *slot, ref[TRFS_MAX_CHUNKS];
+	u64 hash[TRFS_MAX_CHUNKS];
+	bool is_ref[TRFS_MAX_CHUNKS];
+	u32 off, n, nr_full;
+	u16 i;
+	u8 kind;
+
+	len = min_t(u32, len, TRFS_MAX_CHUNKS * TRFS_DEDUP_CHUNK);
+	nr_full = len / TRFS_DEDUP_CHUNK;
+	for (i = 0; i < nr_full; i++)
+		hash[i] = trfs_chunk_hash(data + i * TRFS_DEDUP_CHUNK,
+					  TRFS_DEDUP_CHUNK);
+
+	if (nr_full)
+		spin_lock(&sbi->dedup_lock);
+	for (i = 0; i < nr_full; i++) {
+		slot = &sbi->dedup_slots[hash_64(hash[i], TRFS_DEDUP_BITS)];
+		/* a later record may have taken the slot meanwhile */
+		is_ref[i] = slot->used && slot->hash == hash[i] &&
+			    slot->record_id <= rec->id &&
+			    rec->id - slot->record_id < TRFS_DEDUP_WINDOW;
+		if (is_ref[i])
+			ref[i] = *slot;
+		slot->hash = hash[i];
+		slot->record_id = rec->id;
+		slot->index = i;
+		slot->used = true;
+	}
+	if (nr_full)
+		spin_unlock(&sbi->dedup_lock);
+
+	for (i = 0, off = 0; off < len; i++, off += n) {
+		n = min_t(u32, len - off, TRFS_DEDUP_CHUNK);
+		kind = i < nr_full && is_ref[i] ? TRFS_CHUNK_REF :
+						  TRFS_CHUNK_DATA;
+		trfs_record_put(rec, &kind, sizeof(kind));
+		if (kind == TRFS_CHUNK_REF) {
+			trfs_record_put(rec, &ref[i].record_id,
+					sizeof(ref[i].record_id));
+			trfs_record_put(rec, &ref[i].index,
+					sizeof(ref[i].index));
+		} else {
+			trfs_record_put(rec, data + off, n);
+		}
+	}
+}
+
+/* finish a record and release the sink */
+void trfs_record_end(struct trfs_record *rec)
+{
+	trfs_record_commit(rec);
+	mutex_unlock(&rec->sink->lock);
+}
+
+static unsigned long trfs_shrink_count(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct trfs_sb_info *sbi =
+		container_of(shrink, struct trfs_sb_info, shrinker);
+
+	return (atomic_long_read(&sbi->mem_used) - TRFS_MAX_RECORD) >>
+		PAGE_SHIFT;
+}
+
+/*
+ * Under memory pressure write out every buffered record early, and give
+ * back the buffers of sinks that saw no records since the last scan.  A
+ * busy sink will just allocate again, within the budget.
+ */
+static unsigned long trfs_shrink_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct trfs_sb_info *sbi =
+		container_of(shrink, struct trfs_sb_info, shrinker);
+	struct trfs_sink *sink;
+	unsigned long freed = 0;
+	int i;
+
+	/* flushing writes to the tfile, so don't recurse into a fs */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	for (i = 0; i < sbi->nr_sinks && freed < sc->nr_to_scan; i++) {
+		sink = &sbi->sinks[i];
+		if (!mutex_trylock(&sink->lock))
+			continue;
+		trfs_sink_flush(sink);
+		if (sink->buffer && !sink->active) {
+			freed += DIV_ROUND_UP(sink->size, PAGE_SIZE);
+			trfs_sink_free(sbi, sink);
+		}
+		sink->active = false;
+		mutex_unlock(&sink->lock);
+	}
+
+	atomic_long_add(freed, &sbi->nr_shrunk);
+	return freed;
+}
+
+/*
+ * Write out what every sink has buffered and, with @sync, fsync the
+ * tfiles.  Returns the first fsync error.
+ */
+int trfs_flush_sinks(struct trfs_sb_info *sbi, bool sync)
+{
+	struct trfs_sink *sink;
+	int i, err, ret = 0;
+
+	for (i = 0; i < sbi->nr_sinks; i++) {
+		sink = &sbi->sinks[i];
+		if (!sink->tf)
+			continue;
+		mutex_lock(&sink->lock);
+		trfs_sink_flush(sink);
+		mutex_unlock(&sink->lock);
+		if (!sync)
+			continue;
+		err = vfs_fsync(sink->tf, 0);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/*
+ * Make the trace durable up to a 'Z' checkpoint record: @reason ('s'
+ * sync, 'f' freeze, 'u' unfreeze) and the wall clock time in ns.  The
+ * open coalesced runs are ended and the checkpoint goes in, then the
+ * lower fs is synced and only then are the sinks flushed and synced: so
+ * every op that finished before we were called is in the tfiles with a
+ * lower record id, and once the checkpoint is on disk so is what those
+ * ops did to the lower fs.  At freeze no write can start any more, so
+ * the writes before the 'f' checkpoint are exactly those in the
+ * snapshot.
+ */
+int trfs_checkpoint(struct trfs_sb_info *sbi, char reason)
+{
+	struct trfs_record rec;
+	struct super_block *lower_sb;
+	u64 now;
+	int err, ret;
+
+	if (!sbi || !sbi->sinks)
+		return 0;
+	trfs_end_runs(sbi, true);
+	now = ktime_get_real_ns();
+	if (!trfs_record_begin(sbi, &rec, 'Z', TRFS_REC_HDR_SIZE +
+			       sizeof(reason) + sizeof(now))) {
+		trfs_record_put(&rec, &reason, sizeof(reason));
+		trfs_record_put(&rec, &now, sizeof(now));
+		trfs_record_end(&rec);
+	}
+
+	/* as overlayfs does, the lower sb's s_umount nests inside ours */
+	lower_sb = sbi->lower_sb;
+	down_read(&lower_sb->s_umount);
+	err = sync_filesystem(lower_sb);
+	up_read(&lower_sb->s_umount);
+
+	ret = trfs_flush_sinks(sbi, true);
+	return err ? err : ret;
+}
+
+/* sbi->flush_work: write out what deferred records left buffered */
+static void trfs_flush_work(struct work_struct *work)
+{
+	struct trfs_sb_info *sbi =
+		container_of(work, struct trfs_sb_info, flush_work);
+
+	trfs_flush_sinks(sbi, false);
+}
+
+void trfs_destroy_sinks(struct trfs_sb_info *sbi)
+{
+	struct trfs_sink *sink;
+	int i;
+
+	if (!sbi->sinks)
+		return;
+	unregister_shrinker(&sbi->shrinker);
+	/* every file is closed, so no run is open, but the work may be */
+	cancel_delayed_work_sync(&sbi->run_work);
+	cancel_work_sync(&sbi->flush_work);
+	for (i = 0; i < sbi->nr_sinks; i++) {
+		sink = &sbi->sinks[i];
+		if (sink->tf) {
+			trfs_sink_free(sbi, sink);
+			filp_close(sink->tf, NULL);
+		}
+	}
+	free_percpu(sbi->getattr_count);
+	free_percpu(sbi->fault_count);
+	trfs_free_ctx(sbi);
+	kfree(sbi->dedup_slots);
+	kfree(sbi->reserve);
+	kfree(sbi->sinks);
+	sbi->getattr_count = NULL;
+	sbi->fault_count = NULL;
+	sbi->dedup_slots = NULL;
+	sbi->reserve = NULL;
+	sbi->sinks = NULL;
+	sbi->nr_sinks = 0;
+}
+
+/*
+ * Open the tfile(s).  A single sink uses @tfile_path as is; per-cpu and
+ * per-node sinks use @tfile_path.<n> for every possible cpu or node.
+ * Sink buffers of sbi->buf_size bytes are allocated on first use, within
+ * sbi->mem_budget.
+ */
+int trfs_init_sinks(struct trfs_sb_info *sbi, const char *tfile_path,
+		    int mode)
+{
+	int i, nr, err = 0;
+	char *name;
+	struct trfs_sink *sink;
+
+	switch (mode) {
+	case TRFS_SINK_CPU:
+		nr = nr_cpu_ids;
+		break;
+	case TRFS_SINK_NODE:
+		nr = nr_node_ids;
+		break;
+	default:
+		nr = 1;
+		break;
+	}
+
+	/* the reserve is always there, so it's the first thing charged */
+	mutex_init(&sbi->reserve_lock);
+	sbi->reserve = kmalloc(TRFS_MAX_RECORD, GFP_KERNEL);
+	sbi->sinks = kcalloc(nr, sizeof(struct trfs_sink), GFP_KERNEL);
+	if (!sbi->reserve || !sbi->sinks) {
+		err = -ENOMEM;
+		goto out_err;
+	}
+	atomic_long_set(&sbi->mem_used, TRFS_MAX_RECORD);
+	sbi->nr_sinks = nr;
+	sbi->sink_mode = mode;
+
+	for (i = 0; i < nr; i++) {
+		sink = &sbi->sinks[i];
+		mutex_init(&sink->lock);
+
+		if (mode == TRFS_SINK_SINGLE)
+			name = kstrdup(tfile_path, GFP_KERNEL);
+		else
+			name = kasprintf(GFP_KERNEL, "%s.%d", tfile_path, i);
+		if (!name) {
+			err = -ENOMEM;
+			goto out_err;
+		}
+		sink->tf = filp_open(name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (IS_ERR(sink->tf)) {
+			printk(KERN_ERR "trfs: cannot open tfile %s\n", name);
+			err = PTR_ERR(sink->tf);
+			sink->tf = NULL;
+			kfree(name);
+			goto out_err;
+		}
+		kfree(name);
+	}
+
+	sbi->getattr_sample = 1;
+	sbi->fault_sample = TRFS_FAULT_SAMPLE;
+	sbi->payload_cap = -1;
+	sbi->getattr_count = alloc_percpu(unsigned int);
+	sbi->fault_count = alloc_percpu(unsigned int);
+	spin_lock_init(&sbi->ctx_lock);
+	sbi->ctx_hash = kcalloc(1 << TRFS_CTX_BITS,
+				sizeof(struct hlist_head), GFP_KERNEL);
+	sbi->ctx_prune_at = TRFS_CTX_PRUNE;
+	mutex_init(&sbi->runs_mutex);
+	spin_lock_init(&sbi->runs_lock);
+	INIT_LIST_HEAD(&sbi->runs);
+	INIT_DELAYED_WORK(&sbi->run_work, trfs_expire_runs);
+	INIT_WORK(&sbi->flush_work, trfs_flush_work);
+	spin_lock_init(&sbi->dedup_lock);
+	sbi->dedup_slots = kcalloc(1 << TRFS_DEDUP_BITS,
+				   sizeof(struct trfs_dedup_slot), GFP_KERNEL);
+	if (!sbi->getattr_count || !sbi->fault_count || !sbi->ctx_hash ||
+	    !sbi->dedup_slots) {
+		err = -ENOMEM;
+		goto out_err;
+	}
+
+	sbi->shrinker.count_objects = trfs_shrink_count;
+	sbi->shrinker.scan_objects = trfs_shrink_scan;
+	sbi->shrinker.seeks = DEFAULT_SEEKS;
+	err = register_shrinker(&sbi->shrinker);
+	if (err)
+		goto out_err;
+	return 0;
+
+out_err:
+	for (i = 0; sbi->sinks && i < nr; i++) {
+		if (sbi->sinks[i].tf)
+			filp_close(sbi->sinks[i].tf, NULL);
+	}
+	free_percpu(sbi->getattr_count);
+	free_percpu(sbi->fault_count);
+	trfs_free_ctx(sbi);
+	kfree(sbi->dedup_slots);
+	sbi->getattr_count = NULL;
+	sbi->fault_count = NULL;
+	sbi->dedup_slots = NULL;
+	kfree(sbi->reserve);
+	kfree(sbi->sinks);
+	sbi->reserve = NULL;
+	sbi->sinks = NULL;
+	sbi->nr_sinks = 0;
+	return err;
+}
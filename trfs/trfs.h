@@ -27,6 +27,12 @@
 #include <linux/sched.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/cgroup.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include "../../hw2/trctl.h"
 
 /* the file system name */
 #define TRFS_NAME "trfs"
@@ -53,20 +59,106 @@ extern int trfs_init_inode_cache(void);
 extern void trfs_destroy_inode_cache(void);
 extern int trfs_init_dentry_cache(void);
 extern void trfs_destroy_dentry_cache(void);
+extern int trfs_init_file_cache(void);
+extern void trfs_destroy_file_cache(void);
+extern struct trfs_file_info *trfs_alloc_file_info(void);
+extern void trfs_free_file_info(struct trfs_file_info *info);
+extern bool trfs_end_runs(struct trfs_sb_info *sbi, bool all);
+extern void trfs_expire_runs(struct work_struct *work);
+extern int trfs_init_trace_caches(void);
+extern void trfs_destroy_trace_caches(void);
+extern char *trfs_staging_alloc(void);
+extern void trfs_staging_free(char *buf);
+extern char *trfs_window_alloc(void);
+extern void trfs_window_free(char *buf);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
+extern ssize_t trfs_read_iter(struct kiocb *iocb, struct iov_iter *iter);
+extern ssize_t trfs_write_iter(struct kiocb *iocb, struct iov_iter *iter);
 extern struct dentry *trfs_lookup(struct inode *dir, struct dentry *dentry,
 				    unsigned int flags);
 extern struct inode *trfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
+extern void trfs_set_policy(struct inode *inode, struct dentry *lower_dentry,
+			    struct inode *parent);
+extern int trfs_parse_policy(const char *value, size_t len);
+extern void trfs_change_policy(struct inode *inode, int own_policy);
+extern int trfs_refresh_policy(struct inode *inode);
 extern int trfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
 
+/* largest single record */
+#define TRFS_MAX_RECORD		4096
+
+/* sink buffer size, tbufsize= can raise it to batch records */
+#define TRFS_MIN_BUF_SIZE	TRFS_MAX_RECORD
+#define TRFS_MAX_BUF_SIZE	(4 << 20)
+
+/* default tbudget=, the trace memory one mount may hold */
+#define TRFS_DEFAULT_BUDGET	(16 << 20)
+
+/* default fault_sample knob, faults are too hot to trace them all */
+#define TRFS_FAULT_SAMPLE	64
+
+/* record size, record id, context id and record type, common to every record */
+#define TRFS_REC_HDR_SIZE	(sizeof(u16) + sizeof(int) + sizeof(u32) + \
+				 sizeof(char))
+
+/*
+ * Tasks are interned into small context ids: the first record of a task
+ * is preceded by a 'D' record defining its id.  Ids live in a hash of
+ * 2^TRFS_CTX_BITS buckets looked up under RCU; a task keeps its id for
+ * as long as it lives, entries of exited tasks are pruned once there
+ * are TRFS_CTX_PRUNE of them.
+ */
+#define TRFS_CTX_BITS		8
+#define TRFS_CTX_PRUNE		4096
+
+struct trfs_ctx_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	pid_t pid;
+	u64 start_time;		/* tells a reused pid from the old task */
+	u32 id;
+};
+
+/* recently written chunks of write data, see trfs_record_put_chunks() */
+#define TRFS_DEDUP_BITS		10
+
+struct trfs_dedup_slot {
+	u64 hash;
+	int record_id;
+	u16 index;
+	bool used;
+};
+
+/* where records go: one tfile, or one tfile per cpu / per numa node */
+enum trfs_sink_mode {
+	TRFS_SINK_SINGLE,
+	TRFS_SINK_CPU,
+	TRFS_SINK_NODE,
+};
+
 /* struct for dev_name and tfile path name */
 
 struct trfs_path_info {
 	char *dev_name;
 	char *tfile_path;
+	int sink_mode;
+	size_t buf_size;
+	long mem_budget;
+};
+
+/* a run of contiguous same-direction I/O being coalesced, see file.c */
+struct trfs_io_range {
+	char type;		/* 'r' or 'w', 0 while no run is open */
+	s64 start;
+	s64 end;		/* offset the next op of the run starts at */
+	u32 ops;
+	u64 first_ns;
+	u64 last_ns;
+	u32 pages;		/* pages read, see trfs_probe_cache() */
+	u32 cached;
 };
 
 /* file private data has record_id of the open */
@@ -75,33 +167,172 @@ struct trfs_file_info {
 	const struct vm_operations_struct *lower_vm_ops;
 
 	int record_id;
+	spinlock_t range_lock;
+	struct trfs_io_range range;
+	struct list_head run_node;	/* on sbi->runs once it had a run */
+	bool expiring;		/* its run is being recorded, see file.c */
 };
 
 /* trfs inode data in memory */
+/*
+ * Trace policies, set on lower directories with the TRFS_POLICY_XATTR
+ * xattr ("all", "meta" or "off") and inherited by what is below them.
+ * Every inode caches the policy in effect for it along with the mount's
+ * policy generation, which a policy change bumps; a stale inode works
+ * its policy out again from its ancestors (trfs_refresh_policy).
+ */
+#define TRFS_POLICY_XATTR	XATTR_USER_PREFIX "trfs.policy"
+
+enum trfs_policy {
+	TRFS_POLICY_NONE = -1,	/* own_policy of an inode without one */
+	TRFS_POLICY_ALL,	/* what the bitmap says, the default */
+	TRFS_POLICY_META,	/* none of the TRFS_TRACE_DATA records */
+	TRFS_POLICY_OFF,
+};
+
+/* the data ops left out by TRFS_POLICY_META (splices count as reads/writes) */
+#define TRFS_TRACE_DATA		(TRFS_TRACE_READ | TRFS_TRACE_WRITE | \
+				 TRFS_TRACE_COPY | TRFS_TRACE_FADVISE | \
+				 TRFS_TRACE_FAULT)
+
 struct trfs_inode_info {
 	struct inode *lower_inode;
+	int own_policy;		/* set on this directory, or TRFS_POLICY_NONE */
+	int policy;		/* effective enum trfs_policy, cached */
+	unsigned int policy_gen; /* sbi->policy_gen @policy was worked out at */
 	struct inode vfs_inode;
 };
 
 /* trfs dentry data in memory */
 struct trfs_dentry_info {
-	spinlock_t lock;	/* protects lower_path */
+	seqlock_t lock;		/* lower_path: writers lock, readers retry */
 	struct path lower_path;
+	struct rcu_head rcu;	/* RCU-walk may still see it once released */
+};
+
+/* one tfile stream and the buffer records are encoded into */
+struct trfs_sink {
+	struct mutex lock;	/* protects everything below and tf->f_pos */
+	struct file *tf;
+	char *buffer;		/* NULL until first used, or once shrunk */
+	size_t size;
+	size_t len;		/* bytes buffered, not yet written */
+	bool active;		/* saw records since the last shrinker scan */
 };
 
 /* trfs super-block data in memory */
 struct trfs_sb_info {
 	struct super_block *lower_sb;
-	struct file *tf;
-	char *buffer;
-	char *bufferc;
-	int record_id;
-	int buffer_size;
+	struct trfs_sink *sinks;
+	int nr_sinks;
+	int sink_mode;
+	atomic_t record_id;	/* global sequence across all sinks */
 	int bitmap; 
-	struct mutex buffer_lock;
-	
+	atomic_t policy_gen;	/* bumped on every trace policy change */
+	int getattr_sample;	/* trace 1 in N getattr calls */
+	unsigned int __percpu *getattr_count;
+	int fault_sample;	/* trace 1 in N mmap faults */
+	unsigned int __percpu *fault_count;
+	int coalesce_ms;	/* 0, or the idle time ending a run */
+	struct mutex runs_mutex;	/* one walk of the runs at a time */
+	spinlock_t runs_lock;	/* runs and the files' run_node */
+	struct list_head runs;	/* files with runs, see trfs_end_runs() */
+	struct delayed_work run_work;	/* ends runs left idle */
+	int payload_cap;	/* bytes of data kept per read/write, -1 for all */
+	int dedup;		/* write data dedup on */
+	spinlock_t dedup_lock;
+	struct trfs_dedup_slot *dedup_slots;
+
+	/* task context interning, see trfs_task_ctx() */
+	spinlock_t ctx_lock;	/* adding and pruning entries */
+	struct hlist_head *ctx_hash;
+	u32 last_ctx;
+	unsigned int nr_ctx;
+	unsigned int ctx_prune_at;
+
+	/* trace memory accounting, see trace.c and sysfs.c */
+	size_t buf_size;
+	long mem_budget;
+	atomic_long_t mem_used;
+	atomic_long_t nr_shrunk;
+	atomic_long_t nr_dropped;	/* deferred records with no room */
+	struct work_struct flush_work;	/* writes out deferred records */
+	struct mutex reserve_lock;
+	char *reserve;		/* for sinks the budget had no room for */
+	struct shrinker shrinker;
+	struct kobject kobj;
+	struct completion kobj_unregister;
+};
+
+/* a record being encoded into a sink, see trace.c */
+struct trfs_record {
+	struct trfs_sb_info *sbi;
+	struct trfs_sink *sink;
+	char *start;
+	char *pos;
+	int id;
+	bool deferred;		/* not written out here, see trace.c */
 };
 
+extern int trfs_init_sinks(struct trfs_sb_info *sbi, const char *tfile_path,
+			   int mode);
+extern void trfs_destroy_sinks(struct trfs_sb_info *sbi);
+extern int trfs_flush_sinks(struct trfs_sb_info *sbi, bool sync);
+extern int trfs_checkpoint(struct trfs_sb_info *sbi, char reason);
+extern int trfs_init_sysfs(void);
+extern void trfs_exit_sysfs(void);
+extern int trfs_sysfs_register(struct super_block *sb);
+extern void trfs_sysfs_unregister(struct trfs_sb_info *sbi);
+extern int trfs_record_begin(struct trfs_sb_info *sbi, struct trfs_record *rec,
+			     char type, size_t size);
+extern int trfs_record_begin_deferred(struct trfs_sb_info *sbi,
+				      struct trfs_record *rec, char type,
+				      size_t size);
+extern void trfs_record_end(struct trfs_record *rec);
+
+/* append one field to a record started with trfs_record_begin */
+static inline void trfs_record_put(struct trfs_record *rec, const void *data,
+				   size_t len)
+{
+	memcpy(rec->pos, data, len);
+	rec->pos += len;
+}
+
+extern void trfs_record_put_chunks(struct trfs_record *rec, const char *data,
+				   u32 len);
+extern char *trfs_record_path(struct dentry *dentry, char *buf, int buflen);
+
+/* record space for a path: its length and the NUL terminated string */
+static inline size_t trfs_path_size(const char *path)
+{
+	return sizeof(u16) + strlen(path) + 1;
+}
+
+static inline void trfs_record_put_path(struct trfs_record *rec,
+					const char *path)
+{
+	u16 path_size = strlen(path) + 1;
+
+	trfs_record_put(rec, &path_size, sizeof(path_size));
+	trfs_record_put(rec, path, path_size);
+}
+
+
+/*
+ * Sampling for very hot ops: true for 1 in @rate calls.  The counters are
+ * per-cpu so sampling doesn't bounce a shared cache line between cpus.
+ */
+static inline bool trfs_sample(unsigned int __percpu *count,
+			       unsigned int rate)
+{
+	if (rate <= 1)
+		return true;
+	return this_cpu_inc_return(*count) % rate == 0;
+}
+
+extern void trfs_trace_path_op(struct trfs_sb_info *sbi, char type,
+			       struct dentry *dentry, int err);
+
 /*
  * inode to private data
  *
@@ -120,6 +351,40 @@ static inline struct trfs_inode_info *TRFS_I(const struct inode *inode)
 /* superblock to private data */
 #define TRFS_SB(super) ((struct trfs_sb_info *)(super)->s_fs_info)
 
+/* the trace policy in effect for @inode, worked out again if stale */
+static inline int trfs_inode_policy(struct inode *inode)
+{
+	struct trfs_inode_info *ii = TRFS_I(inode);
+	unsigned int gen = READ_ONCE(ii->policy_gen);
+	int policy;
+
+	smp_rmb();	/* pairs with trfs_refresh_policy() */
+	policy = READ_ONCE(ii->policy);
+	if (unlikely(gen != atomic_read(&TRFS_SB(inode->i_sb)->policy_gen)))
+		policy = trfs_refresh_policy(inode);
+	return policy;
+}
+
+/*
+ * Is the method with bitmap bit @bit (TRFS_TRACE_*) traced, for an op on
+ * @inode (NULL for none): the mount's bitmap, narrowed by the trace
+ * policy in effect for the inode.
+ */
+static inline int trfs_traced(struct trfs_sb_info *sbi, struct inode *inode,
+			      int bit)
+{
+	if (inode) {
+		switch (trfs_inode_policy(inode)) {
+		case TRFS_POLICY_OFF:
+			return 0;
+		case TRFS_POLICY_META:
+			bit &= ~TRFS_TRACE_DATA;
+			break;
+		}
+	}
+	return sbi->bitmap & bit;
+}
+
 /* file to private Data */
 #define TRFS_F(file) ((struct trfs_file_info *)((file)->private_data))
 
@@ -150,33 +415,41 @@ static inline void trfs_set_lower_inode(struct inode *i, struct inode *val)
 	TRFS_I(i)->lower_inode = val;
 }
 
-/* superblock to lower superblock */
-static inline struct super_block *trfs_lower_super(
-	const struct super_block *sb)
-{
-	return TRFS_SB(sb)->lower_sb;
-}
-/* setting tfile to struct trfs_sb_info */
-static inline void trfs_set_tfile(struct super_block *sb,struct file *tfile)
+/*
+ * Attribute copies on the I/O paths.  Storing the lower times and size
+ * into our inode on every read and write kept threads doing I/O on one
+ * file bouncing its cache lines even when nothing had changed, so these
+ * only store what differs.  getattr and close still copy everything.
+ */
+static inline void trfs_update_atime(struct inode *inode,
+				     struct inode *lower_inode)
 {
-	TRFS_SB(sb)->tf = tfile;
+	if (!timespec_equal(&inode->i_atime, &lower_inode->i_atime))
+		inode->i_atime = lower_inode->i_atime;
 }
 
-/*setting tfile buffer to struct trfs_sb_info */
-static inline void trfs_set_tbuffer(struct super_block *sb,char *buf)
+static inline void trfs_update_size_times(struct inode *inode,
+					  struct inode *lower_inode)
 {
-	TRFS_SB(sb)->buffer = buf;
+	if (i_size_read(inode) != i_size_read(lower_inode) ||
+	    inode->i_blocks != lower_inode->i_blocks)
+		fsstack_copy_inode_size(inode, lower_inode);
+	if (!timespec_equal(&inode->i_mtime, &lower_inode->i_mtime) ||
+	    !timespec_equal(&inode->i_ctime, &lower_inode->i_ctime) ||
+	    !timespec_equal(&inode->i_atime, &lower_inode->i_atime))
+		fsstack_copy_attr_times(inode, lower_inode);
 }
 
-static inline void trfs_set_tbufferc(struct super_block *sb, char *buf)
+/* superblock to lower superblock */
+static inline struct super_block *trfs_lower_super(
+	const struct super_block *sb)
 {
-	TRFS_SB(sb)->bufferc = buf;
+	return TRFS_SB(sb)->lower_sb;
 }
-
 /*setting record_id to struct trfs_sb_info */
 static inline void trfs_set_record_id(struct super_block *sb, int record_id)
 {
-	TRFS_SB(sb)->record_id = record_id;
+	atomic_set(&TRFS_SB(sb)->record_id, record_id);
 }
 
 static inline void trfs_set_bitmap(struct super_block *sb, int bitmap) //
@@ -184,13 +457,6 @@ static inline void trfs_set_bitmap(struct super_block *sb, int bitmap) //
 	TRFS_SB(sb)->bitmap = bitmap;
 }
 
-
-
-static inline void trfs_set_buffer_size(struct super_block *sb, int buffer_size)
-{
-	TRFS_SB(sb)->buffer_size = buffer_size;
-}
-
 static inline void trfs_set_lower_super(struct super_block *sb,
 					  struct super_block *val)
 {
@@ -203,14 +469,39 @@ static inline void pathcpy(struct path *dst, const struct path *src)
 	dst->dentry = src->dentry;
 	dst->mnt = src->mnt;
 }
+/*
+ * lower_path is set once at interpose time and dropped in ->d_release, so
+ * readers take no lock: they copy it under the seqcount and retry in the
+ * unlikely case a writer got in between.
+ */
+static inline void __trfs_read_lower_path(const struct dentry *dent,
+					  struct path *lower_path)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&TRFS_D(dent)->lock);
+		pathcpy(lower_path, &TRFS_D(dent)->lower_path);
+	} while (read_seqretry(&TRFS_D(dent)->lock, seq));
+}
 /* Returns struct path.  Caller must path_put it. */
 static inline void trfs_get_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
-	spin_lock(&TRFS_D(dent)->lock);
-	pathcpy(lower_path, &TRFS_D(dent)->lower_path);
+	__trfs_read_lower_path(dent, lower_path);
 	path_get(lower_path);
-	spin_unlock(&TRFS_D(dent)->lock);
+	return;
+}
+/*
+ * Returns struct path without taking references, so no shared refcount
+ * is dirtied.  Only for callers that hold @dent for as long as they use
+ * the path: our dentry pins its lower path until ->d_release.  Nothing
+ * to put.
+ */
+static inline void trfs_peek_lower_path(const struct dentry *dent,
+					  struct path *lower_path)
+{
+	__trfs_read_lower_path(dent, lower_path);
 	return;
 }
 static inline void trfs_put_lower_path(const struct dentry *dent,
@@ -222,27 +513,27 @@ static inline void trfs_put_lower_path(const struct dentry *dent,
 static inline void trfs_set_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
-	spin_lock(&TRFS_D(dent)->lock);
+	write_seqlock(&TRFS_D(dent)->lock);
 	pathcpy(&TRFS_D(dent)->lower_path, lower_path);
-	spin_unlock(&TRFS_D(dent)->lock);
+	write_sequnlock(&TRFS_D(dent)->lock);
 	return;
 }
 static inline void trfs_reset_lower_path(const struct dentry *dent)
 {
-	spin_lock(&TRFS_D(dent)->lock);
+	write_seqlock(&TRFS_D(dent)->lock);
 	TRFS_D(dent)->lower_path.dentry = NULL;
 	TRFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&TRFS_D(dent)->lock);
+	write_sequnlock(&TRFS_D(dent)->lock);
 	return;
 }
 static inline void trfs_put_reset_lower_path(const struct dentry *dent)
 {
 	struct path lower_path;
-	spin_lock(&TRFS_D(dent)->lock);
+	write_seqlock(&TRFS_D(dent)->lock);
 	pathcpy(&lower_path, &TRFS_D(dent)->lower_path);
 	TRFS_D(dent)->lower_path.dentry = NULL;
 	TRFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&TRFS_D(dent)->lock);
+	write_sequnlock(&TRFS_D(dent)->lock);
 	path_put(&lower_path);
 	return;
 }